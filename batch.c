@@ -0,0 +1,391 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pocketgb.h"
+
+// One line of the manifest, and what running it produced.
+struct job {
+  char* rom;
+  // NULL to run without input.
+  char* movie;
+  unsigned long frames;
+  // Set if the job couldn't run; the results below are then meaningless.
+  const char* error;
+  uint64_t cycles;
+  uint64_t wall_ns;
+  uint64_t frame_hash;
+  char* serial;
+  size_t serial_length;
+};
+
+// From frame on, exactly buttons are held.
+struct input {
+  unsigned long frame;
+  uint8_t buttons;
+};
+
+struct pool;
+
+// A worker's share of the jobs.  Its range of job indices, [lo, hi), is
+// packed into one word so the owner can take from the front while thieves
+// take from the back, without a lock.  Jobs never move between workers, so
+// once every range is empty all jobs have been claimed.
+struct worker {
+  _Atomic uint64_t range;
+  struct pool* pool;
+  unsigned id;
+  pthread_t thread;
+} __attribute__((aligned(64)));
+
+struct pool {
+  struct job* jobs;
+  struct worker* workers;
+  unsigned num_workers;
+  const char* bios;
+};
+
+static uint64_t pack_range (const uint32_t lo, const uint32_t hi) {
+  return (uint64_t)lo << 32 | hi;
+}
+
+static bool take_front (struct worker* const w, uint32_t* const index) {
+  uint64_t range = atomic_load_explicit(&w->range, memory_order_relaxed);
+  uint32_t lo, hi;
+  do {
+    lo = range >> 32;
+    hi = (uint32_t)range;
+    if (lo >= hi) return false;
+  } while (!atomic_compare_exchange_weak(&w->range, &range,
+        pack_range(lo + 1, hi)));
+  *index = lo;
+  return true;
+}
+
+static bool take_back (struct worker* const w, uint32_t* const index) {
+  uint64_t range = atomic_load_explicit(&w->range, memory_order_relaxed);
+  uint32_t lo, hi;
+  do {
+    lo = range >> 32;
+    hi = (uint32_t)range;
+    if (lo >= hi) return false;
+  } while (!atomic_compare_exchange_weak(&w->range, &range,
+        pack_range(lo, hi - 1)));
+  *index = hi - 1;
+  return true;
+}
+
+// Tries every other worker in turn, starting with the next one along.
+static bool steal (struct worker* const self, uint32_t* const index) {
+  const struct pool* const pool = self->pool;
+  for (unsigned i = 1; i < pool->num_workers; ++i) {
+    struct worker* const victim =
+      &pool->workers[(self->id + i) % pool->num_workers];
+    if (take_back(victim, index)) return true;
+  }
+  return false;
+}
+
+static uint64_t now_ns (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// FNV-1a
+static uint64_t hash_frame (const uint8_t* const pixels) {
+  uint64_t hash = 0xCBF29CE484222325;
+  for (int i = 0; i < GB_SCREEN_WIDTH * GB_SCREEN_HEIGHT; ++i) {
+    hash = (hash ^ pixels[i]) * 0x100000001B3;
+  }
+  return hash;
+}
+
+// "none", or button names joined by '+', as in "a+start".
+// Returns 0 on success
+static int parse_buttons (char* const names, uint8_t* const buttons) {
+  static const char* const kNames [8] = {
+    "right", "left", "up", "down", "a", "b", "select", "start",
+  };
+  *buttons = 0;
+  if (!strcmp(names, "none")) return 0;
+  char* save = NULL;
+  for (char* name = strtok_r(names, "+", &save); name;
+      name = strtok_r(NULL, "+", &save)) {
+    int bit = 0;
+    while (bit < 8 && strcmp(name, kNames[bit])) ++bit;
+    if (bit == 8) return -1;
+    *buttons |= 1 << bit;
+  }
+  return 0;
+}
+
+// A movie has a line per change of input, "<frame> <buttons>", in frame
+// order; blank lines and lines starting with # are skipped.
+// Returns 0 on success
+static int load_movie (const char* const path, struct input** const inputs,
+    size_t* const count) {
+  int rc = -1;
+  FILE* const f = fopen(path, "r");
+  if (!f) return -1;
+  size_t capacity = 0;
+  char* line = NULL;
+  size_t line_size = 0;
+  *inputs = NULL;
+  *count = 0;
+  while (getline(&line, &line_size, f) != -1) {
+    char* save = NULL;
+    char* const frame = strtok_r(line, " \t\r\n", &save);
+    if (!frame || frame[0] == '#') continue;
+    char* const names = strtok_r(NULL, " \t\r\n", &save);
+    struct input input;
+    char* end;
+    input.frame = strtoul(frame, &end, 10);
+    if (*end || !names || parse_buttons(names, &input.buttons)) goto close;
+    if (*count && input.frame < (*inputs)[*count - 1].frame) goto close;
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      struct input* const grown = realloc(*inputs, capacity * sizeof(input));
+      if (!grown) goto close;
+      *inputs = grown;
+    }
+    (*inputs)[(*count)++] = input;
+  }
+  rc = 0;
+close:
+  free(line);
+  fclose(f);
+  if (rc) {
+    free(*inputs);
+    *inputs = NULL;
+  }
+  return rc;
+}
+
+static void run_job (struct job* const job, const char* const bios) {
+  const uint64_t start = now_ns();
+  struct input* inputs = NULL;
+  size_t num_inputs = 0;
+  if (job->movie && load_movie(job->movie, &inputs, &num_inputs)) {
+    job->error = "unable to load movie";
+    goto done;
+  }
+  struct gb_system* const gb = gb_create(bios, job->rom, false);
+  if (!gb) {
+    job->error = "unable to load ROM";
+    goto free_inputs;
+  }
+  size_t next = 0;
+  for (unsigned long frame = 0; frame < job->frames; ++frame) {
+    while (next < num_inputs && inputs[next].frame <= frame) {
+      gb_set_buttons(gb, inputs[next++].buttons);
+    }
+    gb_run_frame(gb);
+  }
+  job->cycles = gb_cycles(gb);
+  job->frame_hash = hash_frame(gb_framebuffer(gb));
+  size_t length;
+  const char* const serial = gb_serial_output(gb, &length);
+  job->serial = malloc(length ? length : 1);
+  if (job->serial) {
+    memcpy(job->serial, serial, length);
+    job->serial_length = length;
+  }
+  gb_destroy(gb);
+free_inputs:
+  free(inputs);
+done:
+  job->wall_ns = now_ns() - start;
+}
+
+static void* work (void* arg) {
+  struct worker* const self = arg;
+  uint32_t index;
+  while (take_front(self, &index) || steal(self, &index)) {
+    run_job(&self->pool->jobs[index], self->pool->bios);
+  }
+  return NULL;
+}
+
+static void free_jobs (struct job* const jobs, const size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    free(jobs[i].rom);
+    free(jobs[i].movie);
+    free(jobs[i].serial);
+  }
+  free(jobs);
+}
+
+// A manifest has a line per job, "<rom> <movie or -> <frames>"; blank lines
+// and lines starting with # are skipped.
+// Returns 0 on success
+static int load_manifest (FILE* const f, struct job** const jobs,
+    size_t* const count) {
+  size_t capacity = 0;
+  char* line = NULL;
+  size_t line_size = 0;
+  unsigned long line_number = 0;
+  *jobs = NULL;
+  *count = 0;
+  while (getline(&line, &line_size, f) != -1) {
+    ++line_number;
+    char* save = NULL;
+    const char* const rom = strtok_r(line, " \t\r\n", &save);
+    if (!rom || rom[0] == '#') continue;
+    const char* const movie = strtok_r(NULL, " \t\r\n", &save);
+    const char* const frames = strtok_r(NULL, " \t\r\n", &save);
+    char* end = NULL;
+    const unsigned long n = frames ? strtoul(frames, &end, 10) : 0;
+    if (!movie || !frames || *end) {
+      fprintf(stderr, "manifest line %lu: expected <rom> <movie or -> "
+          "<frames>\n", line_number);
+      goto error;
+    }
+    if (*count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      struct job* const grown = realloc(*jobs, capacity * sizeof(**jobs));
+      if (!grown) goto error;
+      *jobs = grown;
+    }
+    struct job* const job = &(*jobs)[(*count)++];
+    memset(job, 0, sizeof(*job));
+    job->rom = strdup(rom);
+    job->movie = strcmp(movie, "-") ? strdup(movie) : NULL;
+    job->frames = n;
+    if (!job->rom || (strcmp(movie, "-") && !job->movie)) goto error;
+  }
+  free(line);
+  return 0;
+error:
+  free(line);
+  free_jobs(*jobs, *count);
+  *jobs = NULL;
+  *count = 0;
+  return -1;
+}
+
+static void print_escaped (const char* const s, const size_t length) {
+  for (size_t i = 0; i < length; ++i) {
+    const unsigned char c = s[i];
+    if (c == '\\') {
+      fputs("\\\\", stdout);
+    } else if (c == '\n') {
+      fputs("\\n", stdout);
+    } else if (c == '\t') {
+      fputs("\\t", stdout);
+    } else if (c < 0x20 || c >= 0x7F) {
+      printf("\\x%02x", c);
+    } else {
+      putchar(c);
+    }
+  }
+}
+
+static void usage (void) {
+  fprintf(stderr, "USAGE: ./pocketgb-batch [-j threads] [-b bios.gb] "
+      "<manifest or ->\n"
+      "Runs each \"<rom> <movie or -> <frames>\" line of the manifest, and\n"
+      "prints a tab separated line of results per job, in manifest order.\n"
+      "Movies have a \"<frame> <buttons>\" line per change of input, where\n"
+      "buttons is none or names like a+start.\n");
+}
+
+int main (int argc, char** argv) {
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* bios = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:b:")) != -1) {
+    switch (opt) {
+      case 'j':
+        threads = strtol(optarg, NULL, 10);
+        break;
+      case 'b':
+        bios = optarg;
+        break;
+      default:
+        usage();
+        return -1;
+    }
+  }
+  if (argc - optind != 1 || threads < 1) {
+    usage();
+    return -1;
+  }
+
+  const char* const path = argv[optind];
+  FILE* const manifest = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if (!manifest) {
+    fprintf(stderr, "unable to open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  struct job* jobs;
+  size_t num_jobs;
+  const int rc = load_manifest(manifest, &jobs, &num_jobs);
+  if (manifest != stdin) fclose(manifest);
+  if (rc) return -1;
+  if (num_jobs > UINT32_MAX) {
+    free_jobs(jobs, num_jobs);
+    return -1;
+  }
+
+  struct pool pool = {
+    .jobs = jobs,
+    .num_workers = num_jobs < (size_t)threads ? num_jobs : (size_t)threads,
+    .bios = bios,
+  };
+  pool.workers = pool.num_workers ?
+    aligned_alloc(64, pool.num_workers * sizeof(struct worker)) : NULL;
+  if (!pool.workers) {
+    free_jobs(jobs, num_jobs);
+    return pool.num_workers ? -1 : 0;
+  }
+  // Contiguous shares to start with; stealing evens out the rest.
+  const uint64_t start = now_ns();
+  for (unsigned i = 0; i < pool.num_workers; ++i) {
+    struct worker* const w = &pool.workers[i];
+    atomic_init(&w->range, pack_range(num_jobs * i / pool.num_workers,
+          num_jobs * (i + 1) / pool.num_workers));
+    w->pool = &pool;
+    w->id = i;
+  }
+  // The calling thread is worker 0.
+  unsigned started = 1;
+  for (; started < pool.num_workers; ++started) {
+    struct worker* const w = &pool.workers[started];
+    if (pthread_create(&w->thread, NULL, work, w)) break;
+  }
+  work(&pool.workers[0]);
+  for (unsigned i = 1; i < started; ++i) {
+    pthread_join(pool.workers[i].thread, NULL);
+  }
+  // Shares of threads that failed to start are simply stolen by the rest.
+  const uint64_t wall_ns = now_ns() - start;
+
+  int failed = 0;
+  puts("# rom\tframes\tcycles\twall_us\tframe_hash\tserial");
+  for (size_t i = 0; i < num_jobs; ++i) {
+    const struct job* const job = &jobs[i];
+    if (job->error) {
+      printf("%s\terror: %s\n", job->rom, job->error);
+      failed = 1;
+      continue;
+    }
+    printf("%s\t%lu\t%" PRIu64 "\t%" PRIu64 "\t%016" PRIx64 "\t", job->rom,
+        job->frames, job->cycles, job->wall_ns / 1000, job->frame_hash);
+    print_escaped(job->serial, job->serial_length);
+    putchar('\n');
+  }
+  fprintf(stderr, "%zu jobs on %u threads in %.3fs\n", num_jobs,
+      pool.num_workers, wall_ns / 1e9);
+
+  free_jobs(jobs, num_jobs);
+  free(pool.workers);
+  return failed;
+}
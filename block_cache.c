@@ -0,0 +1,233 @@
+#include "block_cache.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+
+// Instruction lengths in bytes, including the opcode.  0xCB counts its
+// second opcode byte as an immediate.
+static const uint8_t op_lengths [256] = {
+  1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1, // 0x00
+  2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x10
+  2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x20
+  2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 0x30
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x50
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x70
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x80
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x90
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xA0
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xB0
+  1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // 0xC0
+  1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1, // 0xD0
+  2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1, // 0xE0
+  2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1, // 0xF0
+};
+
+// Jumps, calls, returns and anything that stops the CPU end a block, as do
+// the opcodes that don't exist.
+static bool ends_block (const uint8_t op) {
+  switch (op) {
+    case 0x10: // STOP
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // JR
+    case 0x76: // HALT
+    case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9: // RET
+    case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9: // JP
+    case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC: // CALL
+    case 0xC7: case 0xCF: case 0xD7: case 0xDF: // RST
+    case 0xE7: case 0xEF: case 0xF7: case 0xFF: // RST
+    case 0xD3: case 0xDB: case 0xDD: case 0xE3: case 0xE4: case 0xEB:
+    case 0xEC: case 0xED: case 0xF4: case 0xFC: case 0xFD: // invalid
+      return true;
+    default:
+      return false;
+  }
+}
+
+static size_t slot_for (const uint16_t pc) {
+  return pc & (BLOCK_CACHE_SIZE - 1);
+}
+
+// Whether addr falls within [start, last], allowing for blocks that wrap
+// around the top of the address space.
+static bool block_covers (const struct block* const block,
+    const uint16_t addr) {
+  return (uint16_t)(addr - block->start) <=
+    (uint16_t)(block->last - block->start);
+}
+
+static bool any_slots (const uint64_t* const slots) {
+  uint64_t any = 0;
+  for (size_t i = 0; i < BLOCK_CACHE_SIZE / 64; ++i) {
+    any |= slots[i];
+  }
+  return any != 0;
+}
+
+// Sets or clears the block's slot in each chunk it covers.
+static void mark_chunks (struct block_cache* const cache,
+    const struct block* const block, const bool covered) {
+  const size_t slot = block - cache->blocks;
+  uint16_t chunk = block->start >> CODE_CHUNK_SHIFT;
+  const uint16_t last = block->last >> CODE_CHUNK_SHIFT;
+  while (1) {
+    uint64_t* const slots = cache->chunk_slots[chunk];
+    if (covered) {
+      slots[slot / 64] |= 1ULL << (slot % 64);
+      cache->code_chunks[chunk] = 1;
+    } else {
+      slots[slot / 64] &= ~(1ULL << (slot % 64));
+      cache->code_chunks[chunk] = any_slots(slots);
+    }
+    if (chunk == last) break;
+    chunk = (chunk + 1) & (CODE_CHUNKS - 1);
+  }
+}
+
+// LY, STAT and IF only change when a scheduled event fires.
+static bool reads_polled_register (const struct decoded_op* const op) {
+  uint16_t addr;
+  switch (op->op) {
+    case 0xF0: // LDH A,(a8)
+      addr = 0xFF00 | op->imm[0];
+      break;
+    case 0xFA: // LD A,(a16)
+      addr = (op->imm[1] << 8) | op->imm[0];
+      break;
+    default:
+      return false;
+  }
+  return addr == 0xFF44 || addr == 0xFF41 || addr == 0xFF0F;
+}
+
+// Tests of A that write nothing but A and the flags.
+static bool tests_a (const struct decoded_op* const op) {
+  switch (op->op) {
+    case 0xA7: // AND A
+    case 0xB7: // OR A
+    case 0xE6: // AND d8
+    case 0xFE: // CP d8
+      return true;
+    case 0xCB: // BIT n,A
+      return (op->imm[0] & 0xC7) == 0x47;
+    default:
+      return false;
+  }
+}
+
+// Where a conditional jump goes if taken, or -1 for anything else.
+static int32_t conditional_target (const struct decoded_op* const op) {
+  switch (op->op) {
+    case 0x20: case 0x28: case 0x30: case 0x38: // JR cc,r8
+      return (uint16_t)(op->pc + 2 + (int8_t)op->imm[0]);
+    case 0xC2: case 0xCA: case 0xD2: case 0xDA: // JP cc,a16
+      return (op->imm[1] << 8) | op->imm[0];
+    default:
+      return -1;
+  }
+}
+
+// Matches loops like LDH A,(0xFF44); CP 144; JR NZ,-6 that reread a register
+// and test it, changing nothing else.  Every pass computes the same thing
+// until the next event, so they can be skipped up to it.
+static bool is_polling_loop (const struct block* const block) {
+  if (block->count < 2 || !reads_polled_register(&block->ops[0])) {
+    return false;
+  }
+  for (int i = 1; i < block->count - 1; ++i) {
+    if (!tests_a(&block->ops[i])) return false;
+  }
+  return conditional_target(&block->ops[block->count - 1]) == block->start;
+}
+
+static const uint8_t* source_of (const struct mmu* const mmu,
+    const uint16_t pc) {
+  const uint8_t* const page = mmu->read_pages[pc >> 8];
+  return page ? page + (pc & 0xFF) : NULL;
+}
+
+static void decode_block (struct block* const block,
+    const struct mmu* const mmu, uint16_t pc) {
+  block->start = pc;
+  block->source = source_of(mmu, pc);
+  block->count = 0;
+  while (block->count < BLOCK_MAX_OPS) {
+    // Don't run on into a 16KiB region that may be banked differently.
+    if (block->count && ((pc ^ block->start) & 0xC000)) break;
+    struct decoded_op* const decoded = &block->ops[block->count++];
+    decoded->pc = pc;
+    decoded->op = rb(mmu, pc);
+    decoded->length = op_lengths[decoded->op];
+    decoded->cycles = 4 * decoded->length;
+    for (int i = 1; i < decoded->length; ++i) {
+      decoded->imm[i - 1] = rb(mmu, pc + i);
+    }
+    block->last = pc + decoded->length - 1;
+    pc += decoded->length;
+    if (ends_block(decoded->op)) break;
+  }
+  block->polls = is_polling_loop(block);
+  block->valid = true;
+  block->hits = 0;
+  block->native = NULL;
+  LOG(6, "decoded block " PRIshort "-" PRIshort " (%d ops)\n", block->start,
+      block->last, block->count);
+}
+
+struct block_cache* create_block_cache (void) {
+  return calloc(1, sizeof(struct block_cache));
+}
+
+void destroy_block_cache (struct block_cache* const cache) {
+  free(cache);
+}
+
+struct block* get_block (struct block_cache* const cache,
+    const struct mmu* const mmu, const uint16_t pc) {
+  struct block* const block = &cache->blocks[slot_for(pc)];
+  if (!block->valid || block->start != pc ||
+      block->source != source_of(mmu, pc)) {
+    if (block->valid) {
+      mark_chunks(cache, block, false);
+    }
+    decode_block(block, mmu, pc);
+    mark_chunks(cache, block, true);
+  }
+  assert(block->count > 0);
+  return block;
+}
+
+// Drops every block containing addr, looking only at the slots whose blocks
+// cover addr's chunk.  Dropping them clears the chunk once nothing cached
+// overlaps it anymore.
+void invalidate_code (struct block_cache* const cache, const uint16_t addr) {
+  const uint64_t* const slots = cache->chunk_slots[addr >> CODE_CHUNK_SHIFT];
+  for (size_t i = 0; i < BLOCK_CACHE_SIZE / 64; ++i) {
+    // A copy, as dropping blocks clears their bits.
+    uint64_t bits = slots[i];
+    while (bits) {
+      struct block* const block =
+        &cache->blocks[i * 64 + __builtin_ctzll(bits)];
+      bits &= bits - 1;
+      assert(block->valid);
+      if (!block_covers(block, addr)) continue;
+      LOG(6, "invalidating block " PRIshort "\n", block->start);
+      mark_chunks(cache, block, false);
+      block->valid = false;
+      block->native = NULL;
+    }
+  }
+}
+
+void flush_block_cache (struct block_cache* const cache) {
+  for (size_t i = 0; i < BLOCK_CACHE_SIZE; ++i) {
+    cache->blocks[i].valid = false;
+    cache->blocks[i].native = NULL;
+  }
+  memset(cache->code_chunks, 0, sizeof(cache->code_chunks));
+  memset(cache->chunk_slots, 0, sizeof(cache->chunk_slots));
+}
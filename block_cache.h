@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mmu.h"
+
+// Longest run of instructions decoded into a single block.
+#define BLOCK_MAX_OPS 16
+// Blocks are direct mapped by their starting PC.
+#define BLOCK_CACHE_SIZE 512
+// Writes are checked against cached code at this granularity.
+#define CODE_CHUNK_SHIFT 6
+#define CODE_CHUNKS (65536 >> CODE_CHUNK_SHIFT)
+
+struct decoded_op {
+  uint16_t pc;
+  uint8_t op;
+  uint8_t length;
+  // Cost of fetching the opcode and its immediates, paid up front.
+  uint8_t cycles;
+  uint8_t imm [2];
+};
+
+struct block {
+  uint16_t start;
+  // Host memory the first instruction was decoded from, which tells apart
+  // blocks at the same address in different banks.
+  const uint8_t* source;
+  // Address of the last byte of the last instruction.
+  uint16_t last;
+  uint8_t count;
+  bool valid;
+  // Loops back to start doing nothing but poll LY, STAT or IF.
+  bool polls;
+  // Times the block was entered, and its translation, for the JIT.
+  uint16_t hits;
+  const void* native;
+  struct decoded_op ops [BLOCK_MAX_OPS];
+};
+
+struct block_cache {
+  struct block blocks [BLOCK_CACHE_SIZE];
+  // Nonzero for each chunk of the address space covered by a valid block.
+  uint8_t code_chunks [CODE_CHUNKS];
+  // For each chunk, a bit per slot in blocks whose valid block covers it.
+  uint64_t chunk_slots [CODE_CHUNKS][BLOCK_CACHE_SIZE / 64];
+};
+
+static inline bool is_cached_code (const struct block_cache* const cache,
+    const uint16_t addr) {
+  return cache->code_chunks[addr >> CODE_CHUNK_SHIFT];
+}
+
+struct block_cache* create_block_cache (void);
+void destroy_block_cache (struct block_cache* const cache);
+struct block* get_block (struct block_cache* const cache,
+    const struct mmu* const mmu, const uint16_t pc);
+void invalidate_code (struct block_cache* const cache, const uint16_t addr);
+void flush_block_cache (struct block_cache* const cache);
@@ -0,0 +1,394 @@
+#include "cartridge.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "mmu.h"
+#include "rom_registry.h"
+#include "scheduler.h"
+
+#define ROM_BANK_SIZE 0x4000
+#define RAM_BANK_SIZE 0x2000
+#define CYCLES_PER_SECOND 4194304
+#define SECONDS_PER_DAY 86400
+
+// http://gbdev.gg8.se/wiki/articles/The_Cartridge_Header#0147_-_Cartridge_Type
+static int parse_type (struct cartridge* const cart, const uint8_t type) {
+  cart->has_battery = false;
+  cart->has_rtc = false;
+  switch (type) {
+    case 0x00: // ROM ONLY
+    case 0x08: // ROM+RAM
+      cart->mbc = kMbcNone;
+      break;
+    case 0x09: // ROM+RAM+BATTERY
+      cart->mbc = kMbcNone;
+      cart->has_battery = true;
+      break;
+    case 0x01: // MBC1
+    case 0x02: // MBC1+RAM
+      cart->mbc = kMbc1;
+      break;
+    case 0x03: // MBC1+RAM+BATTERY
+      cart->mbc = kMbc1;
+      cart->has_battery = true;
+      break;
+    case 0x0F: // MBC3+TIMER+BATTERY
+    case 0x10: // MBC3+TIMER+RAM+BATTERY
+      cart->has_rtc = true;
+      // fall through
+    case 0x13: // MBC3+RAM+BATTERY
+      cart->has_battery = true;
+      // fall through
+    case 0x11: // MBC3
+    case 0x12: // MBC3+RAM
+      cart->mbc = kMbc3;
+      break;
+    case 0x1B: // MBC5+RAM+BATTERY
+    case 0x1E: // MBC5+RUMBLE+RAM+BATTERY
+      cart->has_battery = true;
+      // fall through
+    case 0x19: // MBC5
+    case 0x1A: // MBC5+RAM
+    case 0x1C: // MBC5+RUMBLE
+    case 0x1D: // MBC5+RUMBLE+RAM
+      cart->mbc = kMbc5;
+      break;
+    default:
+      fprintf(stderr, "unsupported cartridge type " PRIbyte "\n", type);
+      return -1;
+  }
+  return 0;
+}
+
+static size_t parse_ram_size (const uint8_t code) {
+  static const size_t sizes [] = { 0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000 };
+  return code < sizeof(sizes) / sizeof(sizes[0]) ? sizes[code] : 0;
+}
+
+static int load_rom (struct cartridge* const cart, const char* const path) {
+  cart->image = acquire_rom(path);
+  if (!cart->image) return -1;
+  cart->rom = cart->image->data;
+  cart->rom_length = cart->image->length;
+  cart->file_size = cart->image->file_size;
+  cart->rom_banks = cart->rom_length / ROM_BANK_SIZE;
+  return 0;
+}
+
+// game.gb saves to game.sav
+static char* save_path (const char* const rom_path) {
+  const char* const slash = strrchr(rom_path, '/');
+  const char* dot = strrchr(rom_path, '.');
+  if (!dot || (slash && dot < slash)) {
+    dot = rom_path + strlen(rom_path);
+  }
+  const size_t stem = dot - rom_path;
+  char* const path = malloc(stem + sizeof(".sav"));
+  if (path) {
+    memcpy(path, rom_path, stem);
+    strcpy(path + stem, ".sav");
+  }
+  return path;
+}
+
+// Shared, so that stores to cartridge RAM are stores to the file.
+static uint8_t* map_save_file (const char* const rom_path,
+    const size_t length) {
+  char* const path = save_path(rom_path);
+  if (!path) return NULL;
+  uint8_t* ram = NULL;
+  const int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "failed to open %s\n", path);
+    goto free;
+  }
+  struct stat st;
+  if (fstat(fd, &st) ||
+      ((size_t)st.st_size < length && ftruncate(fd, length))) {
+    fprintf(stderr, "failed to size %s\n", path);
+    goto close;
+  }
+  void* const map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+      fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    goto close;
+  }
+  LOG(1, "saving to %s\n", path);
+  ram = map;
+close:
+  close(fd);
+free:
+  free(path);
+  return ram;
+}
+
+int load_cartridge (struct cartridge* const cart, const char* const path,
+    const bool persist_saves) {
+  assert(cart != NULL);
+  memset(cart, 0, sizeof(*cart));
+  if (load_rom(cart, path)) return -1;
+  if (parse_type(cart, cart->rom[0x147])) goto unload;
+  cart->ram_size = parse_ram_size(cart->rom[0x149]);
+  if (cart->ram_size) {
+    // Always hand out at least a full bank, so whole pages can map it.
+    const size_t length =
+      cart->ram_size < RAM_BANK_SIZE ? RAM_BANK_SIZE : cart->ram_size;
+    if (cart->has_battery && persist_saves) {
+      cart->ram = map_save_file(path, length);
+      cart->ram_mapped = cart->ram != NULL;
+    }
+    // Without a battery, or if the save can't or shouldn't be opened, nothing
+    // persists.
+    if (!cart->ram) {
+      cart->ram = calloc(1, length);
+      if (!cart->ram) goto unload;
+    }
+    cart->ram_length = length;
+    cart->ram_banks = length / RAM_BANK_SIZE;
+  }
+  // Carts without a controller have nothing to enable RAM with.
+  cart->ram_enabled = cart->mbc == kMbcNone;
+  cart->rom_bank = 1;
+  LOG(1, "cartridge type " PRIbyte ", %u ROM banks, %zu bytes RAM\n",
+      cart->rom[0x147], cart->rom_banks, cart->ram_size);
+  return 0;
+unload:
+  unload_cartridge(cart);
+  return -1;
+}
+
+void unload_cartridge (struct cartridge* const cart) {
+  release_rom(cart->image);
+  cart->image = NULL;
+  cart->rom = NULL;
+  if (cart->ram_mapped) {
+    msync(cart->ram, cart->ram_length, MS_SYNC);
+    munmap(cart->ram, cart->ram_length);
+  } else {
+    free(cart->ram);
+  }
+  cart->ram = NULL;
+}
+
+void flush_cartridge (const struct cartridge* const cart) {
+  if (cart->ram_mapped) {
+    msync(cart->ram, cart->ram_length, MS_ASYNC);
+  }
+}
+
+static uint16_t lower_rom_bank (const struct cartridge* const cart) {
+  if (cart->mbc == kMbc1 && cart->mode) {
+    return (cart->ram_bank << 5) % cart->rom_banks;
+  }
+  return 0;
+}
+
+static uint16_t upper_rom_bank (const struct cartridge* const cart) {
+  switch (cart->mbc) {
+    case kMbc1:
+      return ((cart->ram_bank << 5) | cart->rom_bank) % cart->rom_banks;
+    case kMbc3:
+    case kMbc5:
+      return cart->rom_bank % cart->rom_banks;
+    default:
+      return 1;
+  }
+}
+
+// NULL when reads and writes of 0xA000-0xBFFF need cart_ram_read/write.
+static uint8_t* ram_window (const struct cartridge* const cart) {
+  if (!cart->ram || !cart->ram_enabled) {
+    return NULL;
+  }
+  uint8_t bank;
+  switch (cart->mbc) {
+    case kMbc1:
+      bank = cart->mode ? cart->ram_bank : 0;
+      break;
+    case kMbc3:
+      // 0x08-0x0C select RTC registers instead.
+      if (cart->ram_bank > 0x03) return NULL;
+      // fall through
+    case kMbc5:
+      bank = cart->ram_bank;
+      break;
+    default:
+      bank = 0;
+  }
+  return cart->ram + (bank % cart->ram_banks) * RAM_BANK_SIZE;
+}
+
+void map_cartridge (struct mmu* const mem) {
+  const struct cartridge* const cart = &mem->cart;
+  const uint8_t* const lower = cart->rom + lower_rom_bank(cart) * ROM_BANK_SIZE;
+  const uint8_t* const upper = cart->rom + upper_rom_bank(cart) * ROM_BANK_SIZE;
+  for (int page = 0; page < 0x40; ++page) {
+    mem->read_pages[page] = lower + (page << 8);
+    mem->read_pages[page + 0x40] = upper + (page << 8);
+  }
+  if (mem->bios_mapped) {
+    mem->read_pages[0] = mem->bios;
+  }
+  uint8_t* const ram = ram_window(cart);
+  for (int page = 0; page < 0x20; ++page) {
+    mem->read_pages[page + 0xA0] = ram ? ram + (page << 8) : NULL;
+    mem->write_pages[page + 0xA0] = ram ? ram + (page << 8) : NULL;
+  }
+}
+
+static uint64_t now (const struct mmu* const mem) {
+  return mem->scheduler ? mem->scheduler->now : 0;
+}
+
+static uint64_t rtc_seconds (const struct rtc* const rtc, const uint64_t now) {
+  return ((int64_t)(rtc->halted ? rtc->stopped_at : now) - rtc->epoch) /
+    CYCLES_PER_SECOND;
+}
+
+// Splits seconds into the five RTC registers.  The day counter is 9 bits,
+// with a sticky carry once it overflows.
+static void rtc_registers (const struct rtc* const rtc, const uint64_t seconds,
+    uint8_t regs [5]) {
+  const uint64_t days = seconds / SECONDS_PER_DAY;
+  regs[0] = seconds % 60;
+  regs[1] = seconds / 60 % 60;
+  regs[2] = seconds / 3600 % 24;
+  regs[3] = days & 0xFF;
+  regs[4] = ((days >> 8) & 0x01) | (rtc->halted << 6) | ((days > 511) << 7);
+}
+
+static void rtc_latch (struct rtc* const rtc, const uint64_t now) {
+  rtc_registers(rtc, rtc_seconds(rtc, now), rtc->latched);
+}
+
+static void rtc_write (struct rtc* const rtc, const uint64_t now,
+    const uint8_t reg, const uint8_t val) {
+  uint8_t regs [5];
+  rtc_registers(rtc, rtc_seconds(rtc, now), regs);
+  regs[reg] = val;
+  uint64_t days = ((regs[4] & 0x01) << 8) | regs[3];
+  if (regs[4] & 0x80) {
+    days += 512;
+  }
+  const uint64_t seconds =
+    days * SECONDS_PER_DAY + regs[2] * 3600 + regs[1] * 60 + regs[0];
+  rtc->halted = !!(regs[4] & 0x40);
+  rtc->stopped_at = now;
+  rtc->epoch = (int64_t)now - (int64_t)(seconds * CYCLES_PER_SECOND);
+}
+
+static void mbc1_write (struct cartridge* const cart, const uint16_t addr,
+    const uint8_t val) {
+  switch (addr & 0x6000) {
+    case 0x0000:
+      cart->ram_enabled = (val & 0x0F) == 0x0A;
+      break;
+    case 0x2000:
+      cart->rom_bank = (val & 0x1F) ? (val & 0x1F) : 1;
+      break;
+    case 0x4000:
+      cart->ram_bank = val & 0x03;
+      break;
+    case 0x6000:
+      cart->mode = val & 0x01;
+      break;
+  }
+}
+
+static void mbc3_write (struct mmu* const mem, const uint16_t addr,
+    const uint8_t val) {
+  struct cartridge* const cart = &mem->cart;
+  switch (addr & 0x6000) {
+    case 0x0000:
+      cart->ram_enabled = (val & 0x0F) == 0x0A;
+      break;
+    case 0x2000:
+      cart->rom_bank = (val & 0x7F) ? (val & 0x7F) : 1;
+      break;
+    case 0x4000:
+      cart->ram_bank = val & 0x0F;
+      break;
+    case 0x6000:
+      if (cart->has_rtc && cart->rtc.latch_armed && val == 0x01) {
+        rtc_latch(&cart->rtc, now(mem));
+      }
+      cart->rtc.latch_armed = val == 0x00;
+      break;
+  }
+}
+
+static void mbc5_write (struct cartridge* const cart, const uint16_t addr,
+    const uint8_t val) {
+  switch (addr & 0x7000) {
+    case 0x0000:
+    case 0x1000:
+      cart->ram_enabled = (val & 0x0F) == 0x0A;
+      break;
+    case 0x2000:
+      cart->rom_bank = (cart->rom_bank & 0x100) | val;
+      break;
+    case 0x3000:
+      cart->rom_bank = ((val & 0x01) << 8) | (cart->rom_bank & 0xFF);
+      break;
+    case 0x4000:
+    case 0x5000:
+      cart->ram_bank = val & 0x0F;
+      break;
+  }
+}
+
+void mbc_write (struct mmu* const mem, const uint16_t addr, const uint8_t val) {
+  assert(addr < 0x8000);
+  LOG(7, "MBC write " PRIbyte " to " PRIshort "\n", val, addr);
+  switch (mem->cart.mbc) {
+    case kMbc1:
+      mbc1_write(&mem->cart, addr, val);
+      break;
+    case kMbc3:
+      mbc3_write(mem, addr, val);
+      break;
+    case kMbc5:
+      mbc5_write(&mem->cart, addr, val);
+      break;
+    default:
+      // Nothing to write to.
+      return;
+  }
+  map_cartridge(mem);
+}
+
+static bool rtc_selected (const struct cartridge* const cart) {
+  return cart->has_rtc && cart->ram_enabled &&
+    cart->ram_bank >= 0x08 && cart->ram_bank <= 0x0C;
+}
+
+uint8_t cart_ram_read (const struct mmu* const mem, const uint16_t addr) {
+  assert(addr >= 0xA000 && addr < 0xC000);
+  const struct cartridge* const cart = &mem->cart;
+  if (rtc_selected(cart)) {
+    return cart->rtc.latched[cart->ram_bank - 0x08];
+  }
+  // Disabled or missing RAM reads as open bus.
+  LOG(7, "read from unmapped cartridge RAM " PRIshort "\n", addr);
+  return 0xFF;
+}
+
+void cart_ram_write (struct mmu* const mem, const uint16_t addr,
+    const uint8_t val) {
+  assert(addr >= 0xA000 && addr < 0xC000);
+  struct cartridge* const cart = &mem->cart;
+  if (rtc_selected(cart)) {
+    rtc_write(&cart->rtc, now(mem), cart->ram_bank - 0x08, val);
+  } else {
+    LOG(7, "dropped write to cartridge RAM " PRIshort "\n", addr);
+  }
+}
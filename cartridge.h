@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct mmu;
+struct rom_image;
+
+// http://gbdev.gg8.se/wiki/articles/Memory_Bank_Controllers
+enum __attribute__((packed)) MbcType {
+  kMbcNone,
+  kMbc1,
+  kMbc3,
+  kMbc5,
+};
+
+// MBC3 real time clock, counting emulated rather than host time.
+struct rtc {
+  // Cycle count at which the clock read day 0, 00:00:00.
+  int64_t epoch;
+  // Cycle count the clock stopped at, while halted.
+  uint64_t stopped_at;
+  bool halted;
+  // Seconds, minutes, hours, day low, day high, as of the last latch.
+  uint8_t latched [5];
+  // A 0 was written to 0x6000-0x7FFF; a following 1 latches.
+  bool latch_armed;
+};
+
+struct cartridge {
+  // Shared with every other cartridge of the same ROM; rom, rom_length and
+  // file_size are copied out of it.
+  const struct rom_image* image;
+  const uint8_t* rom;
+  size_t rom_length;
+  // Size of the file itself.
+  size_t file_size;
+  uint16_t rom_banks;
+  // Backed by the .sav file for carts with a battery.
+  uint8_t* ram;
+  size_t ram_size;
+  size_t ram_length;
+  bool ram_mapped;
+  uint8_t ram_banks;
+  enum MbcType mbc;
+  bool has_battery;
+  bool has_rtc;
+  // Controller registers.
+  bool ram_enabled;
+  uint16_t rom_bank;
+  // MBC1 upper ROM bits or RAM bank, MBC3 RAM bank or RTC register, MBC5 RAM
+  // bank.
+  uint8_t ram_bank;
+  // MBC1 banking mode.
+  uint8_t mode;
+  struct rtc rtc;
+};
+
+// Returns 0 on success.  Battery RAM is backed by a .sav next to the ROM if
+// persist_saves, or else starts blank and is never written anywhere.
+int load_cartridge (struct cartridge* const cart, const char* const path,
+    const bool persist_saves);
+// Writes back battery RAM, waiting for it to reach the disk.
+void unload_cartridge (struct cartridge* const cart);
+// Starts writing back battery RAM without waiting on it.
+void flush_cartridge (const struct cartridge* const cart);
+// Points the ROM and RAM windows of the page tables at the selected banks.
+void map_cartridge (struct mmu* const mem);
+// Writes to 0x0000-0x7FFF, which go to the controller.
+void mbc_write (struct mmu* const mem, const uint16_t addr, const uint8_t val);
+// Accesses to 0xA000-0xBFFF while no RAM bank is mapped there.
+uint8_t cart_ram_read (const struct mmu* const mem, const uint16_t addr);
+void cart_ram_write (struct mmu* const mem, const uint16_t addr,
+    const uint8_t val);
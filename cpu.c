@@ -4,13 +4,55 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "block_cache.h"
+#ifdef USE_JIT
+#include "jit.h"
+#endif
 #include "logging.h"
+#include "scheduler.h"
 
 #define REG(x) cpu->registers.x
+
+// With USE_COMPUTED_GOTO, every opcode body gets its own label and dispatch
+// jumps straight to it through a table of label addresses (a GNU extension),
+// rather than through the bounds check and jump table of a switch.
+#if defined(USE_COMPUTED_GOTO) && !defined(__GNUC__)
+#undef USE_COMPUTED_GOTO
+#endif
+#ifdef USE_COMPUTED_GOTO
+#define DISPATCH(table, op) goto *table[op];
+#define CASE(op, block) \
+  op_##op: \
+    block; \
+    goto done;
+#define DEFAULT(block) \
+  unhandled: __attribute__((unused)); \
+    block; \
+  done: ;
+#else
+#define DISPATCH(table, op) switch (op)
 #define CASE(op, block) \
   case op: \
     block; \
     break;
+#define DEFAULT(block) \
+  default: \
+    block; \
+    break;
+#endif
+// With USE_LAZY_FLAGS, flag setting operations only record their operands
+// and result; Z, N, H and C are worked out when something reads them.
+// Anything that touches the f bitfield directly must SYNC_FLAGS() first.
+#ifdef USE_LAZY_FLAGS
+#define FLAG(x) flag_##x(cpu)
+#define SYNC_FLAGS() sync_flags(cpu)
+#define SET_FLAGS(kind, lhs, rhs, carry, result, ...) \
+  defer_flags(cpu, kind, lhs, rhs, carry, result)
+#else
+#define FLAG(x) REG(f.x)
+#define SYNC_FLAGS()
+#define SET_FLAGS(kind, lhs, rhs, carry, result, ...) __VA_ARGS__
+#endif
 #define DEREF_DECORATOR(reg, block) \
   uint8_t x = deref_load(cpu, reg); \
   block; \
@@ -40,9 +82,11 @@ static void deref_store_word(struct cpu* const cpu, const uint16_t addr,
   deref_store(cpu, addr, (uint8_t)value);
   deref_store(cpu, addr + 1, value >> 8);
 }
-// Fetches the next byte, incrementing the PC.
+// Fetches the next byte, incrementing the PC.  The bytes come pre-decoded
+// from the block cache, which has already accounted for their cycles.
 static uint8_t fetch_byte(struct cpu* const cpu) {
-  return deref_load(cpu, REG(pc)++);
+  ++REG(pc);
+  return *cpu->imm++;
 }
 static uint16_t fetch_word(struct cpu* const cpu) {
   return (uint16_t)(((uint16_t)fetch_byte(cpu)) |
@@ -70,6 +114,10 @@ static void conditional_jump(struct cpu* const cpu, const uint16_t addr,
   if (cond) {
     cpu->tick_cycles += 4;
     jump(cpu, addr);
+    // Going round a polling loop again; see is_polling_loop.
+    if (cpu->block->polls && addr == cpu->block->start) {
+      cpu->state = kPolling;
+    }
   } else {
     LOG(6, "not jumping\n");
   }
@@ -78,10 +126,20 @@ static void conditional_jump_relative(struct cpu* const cpu,
     const uint8_t cond) {
   assert(cond == 0 || cond == 1);
   const int8_t r8 = (int8_t)fetch_byte(cpu);
-  assert(!((r8 == -2) && cond)); // inf loop
   const uint16_t addr = (uint16_t)((int16_t)REG(pc) + r8);
   conditional_jump(cpu, addr, cond);
 }
+static void halt(struct cpu* const cpu) {
+  cpu->state = kHalted;
+  // Wakes straight back up if an interrupt is already requested.
+  schedule_interrupt_check(cpu->mmu->scheduler);
+}
+static void stop(struct cpu* const cpu) {
+  // STOP is followed by a padding byte.
+  fetch_byte(cpu);
+  cpu->state = kStopped;
+  wb(cpu->mmu, 0xFF04, 0);
+}
 static void call(struct cpu* const cpu, const uint8_t cond) {
   assert(cond == 0 || cond == 1);
   // Looks like the cycle penalty is paid even if we don't take the branch
@@ -113,18 +171,104 @@ static uint8_t get_bit(const uint8_t src, const int index) {
   return (src >> index) & 1U;
 }
 
+#ifdef USE_LAZY_FLAGS
+static void defer_flags(struct cpu* const cpu, const enum FlagsKind kind,
+    const uint8_t lhs, const uint8_t rhs, const uint8_t carry,
+    const uint16_t result) {
+  cpu->lazy.kind = kind;
+  cpu->lazy.lhs = lhs;
+  cpu->lazy.rhs = rhs;
+  cpu->lazy.carry = carry;
+  cpu->lazy.result = result;
+}
+static uint8_t flag_z(const struct cpu* const cpu) {
+  switch (cpu->lazy.kind) {
+    case kFlagsSynced: return REG(f.z);
+    case kFlagsBit: return !get_bit(cpu->lazy.lhs, cpu->lazy.rhs);
+    default: return !(uint8_t)cpu->lazy.result;
+  }
+}
+static uint8_t flag_n(const struct cpu* const cpu) {
+  switch (cpu->lazy.kind) {
+    case kFlagsSynced: return REG(f.n);
+    case kFlagsSub:
+    case kFlagsDec:
+      return 1;
+    default: return 0;
+  }
+}
+static uint8_t flag_h(const struct cpu* const cpu) {
+  const struct lazy_flags* const lazy = &cpu->lazy;
+  switch (lazy->kind) {
+    case kFlagsSynced: return REG(f.h);
+    case kFlagsAdd:
+      return (lazy->lhs & 0x0F) + (lazy->rhs & 0x0F) + lazy->carry > 0x0F;
+    case kFlagsSub:
+      return (uint16_t)((lazy->lhs & 0x0F) - (lazy->rhs & 0x0F) -
+          lazy->carry) > 0x0F;
+    case kFlagsAnd:
+    case kFlagsBit:
+      return 1;
+    case kFlagsInc: return (lazy->result & 0x0F) == 0x00;
+    case kFlagsDec: return (lazy->result & 0x0F) == 0x0F;
+    default: return 0;
+  }
+}
+static uint8_t flag_c(const struct cpu* const cpu) {
+  switch (cpu->lazy.kind) {
+    case kFlagsSynced: return REG(f.c);
+    case kFlagsAdd:
+    case kFlagsSub:
+      return cpu->lazy.result > 0xFF;
+    case kFlagsAnd:
+    case kFlagsLogic:
+      return 0;
+    default: return cpu->lazy.carry;
+  }
+}
+#endif
+
+void reset_flags(struct cpu* const cpu) {
+#ifdef USE_LAZY_FLAGS
+  cpu->lazy.kind = kFlagsSynced;
+#else
+  (void)cpu;
+#endif
+}
+
+void sync_flags(struct cpu* const cpu) {
+#ifdef USE_LAZY_FLAGS
+  if (cpu->lazy.kind == kFlagsSynced) return;
+  const uint8_t z = flag_z(cpu);
+  const uint8_t n = flag_n(cpu);
+  const uint8_t h = flag_h(cpu);
+  const uint8_t c = flag_c(cpu);
+  REG(f.z) = z;
+  REG(f.n) = n;
+  REG(f.h) = h;
+  REG(f.c) = c;
+  cpu->lazy.kind = kFlagsSynced;
+#else
+  (void)cpu;
+#endif
+}
+
 // logical operations
 static void and(struct cpu* const cpu, const uint8_t x) {
   REG(a) &= x;
-  REG(f.z) = !REG(a);
-  REG(f.n) = REG(f.c) = 0;
-  REG(f.h) = 1; // this is weird
+  SET_FLAGS(kFlagsAnd, 0, 0, 0, REG(a), {
+    REG(f.z) = !REG(a);
+    REG(f.n) = REG(f.c) = 0;
+    REG(f.h) = 1; // this is weird
+  });
 }
 static void dec(struct cpu* const cpu, uint8_t* const x) {
   --*x;
-  REG(f.z) = !*x;
-  REG(f.n) = 1;
-  REG(f.h) = (*x & 0x0F) == 0x0F;
+  SET_FLAGS(kFlagsDec, 0, 0, FLAG(c), *x, {
+    REG(f.z) = !*x;
+    REG(f.n) = 1;
+    REG(f.h) = (*x & 0x0F) == 0x0F;
+  });
 }
 static void dec16(struct cpu* const cpu, uint16_t* const x) {
   --*x;
@@ -132,9 +276,11 @@ static void dec16(struct cpu* const cpu, uint16_t* const x) {
 }
 static void inc(struct cpu* const cpu, uint8_t* const x) {
   ++*x;
-  REG(f.z) = !*x;
-  REG(f.n) = 0;
-  REG(f.h) = (*x & 0x0F) == 0x00;
+  SET_FLAGS(kFlagsInc, 0, 0, FLAG(c), *x, {
+    REG(f.z) = !*x;
+    REG(f.n) = 0;
+    REG(f.h) = (*x & 0x0F) == 0x00;
+  });
 }
 static void inc16(struct cpu* const cpu, uint16_t* const x) {
   ++*x;
@@ -142,18 +288,24 @@ static void inc16(struct cpu* const cpu, uint16_t* const x) {
 }
 static void xor(struct cpu* const cpu, const uint8_t x) {
   REG(a) ^= x;
-  REG(f.z) = !REG(a);
-  REG(f.n) = REG(f.h) = REG(f.c) = 0;
+  SET_FLAGS(kFlagsLogic, 0, 0, 0, REG(a), {
+    REG(f.z) = !REG(a);
+    REG(f.n) = REG(f.h) = REG(f.c) = 0;
+  });
 }
 static void or(struct cpu* const cpu, const uint8_t x) {
   REG(a) |= x;
-  REG(f.z) = !REG(a);
-  REG(f.n) = REG(f.h) = REG(f.c) = 0;
+  SET_FLAGS(kFlagsLogic, 0, 0, 0, REG(a), {
+    REG(f.z) = !REG(a);
+    REG(f.n) = REG(f.h) = REG(f.c) = 0;
+  });
 }
 static void bit(struct cpu* const cpu, const uint8_t x, const int index) {
-  REG(f.z) = !get_bit(x, index);
-  REG(f.n) = 0;
-  REG(f.h) = 1;
+  SET_FLAGS(kFlagsBit, x, index, FLAG(c), 0, {
+    REG(f.z) = !get_bit(x, index);
+    REG(f.n) = 0;
+    REG(f.h) = 1;
+  });
 }
 static void set_bit(uint8_t* const x, const int index) {
   assert(index > -1);
@@ -165,82 +317,82 @@ static void reset_bit(uint8_t* const x, const int index) {
   assert(index < 8);
   *x &= ~(1U << index);
 }
+// rotates and shifts all set Z from the result, clear N and H, and set C to
+// the bit shifted out
+static void shifted(struct cpu* const cpu, const uint8_t x,
+    const uint8_t carry) {
+  SET_FLAGS(kFlagsShift, 0, 0, carry, x, {
+    REG(f.z) = !x;
+    REG(f.n) = REG(f.h) = 0;
+    REG(f.c) = carry;
+  });
+}
 static void rotate_left(struct cpu* const cpu, uint8_t* const x) {
   const uint8_t carry = get_bit(*x, 7);
-  *x = (*x << 1) | REG(f.c);
-  REG(f.z) = !*x;
-  REG(f.n) = REG(f.h) = 0;
-  REG(f.c) = carry;
+  *x = (*x << 1) | FLAG(c);
+  shifted(cpu, *x, carry);
 }
 static void rotate_left_c(struct cpu* const cpu, uint8_t* const x) {
   *x = (*x << 1) | (*x >> 7);
-  REG(f.z) = !*x;
-  REG(f.n) = REG(f.h) = 0;
-  REG(f.c) = get_bit(*x, 0);
+  shifted(cpu, *x, get_bit(*x, 0));
 }
 static void rotate_right(struct cpu* const cpu, uint8_t* const x) {
   const uint8_t carry = get_bit(*x, 0);
-  *x = (REG(f.c) << 7) | (*x >> 1);
-  REG(f.z) = !*x;
-  REG(f.n) = REG(f.h) = 0;
-  REG(f.c) = carry;
+  *x = (FLAG(c) << 7) | (*x >> 1);
+  shifted(cpu, *x, carry);
 }
 static void rotate_right_c(struct cpu* const cpu, uint8_t* const x) {
   *x = (*x << 7) | (*x >> 1);
-  REG(f.z) = !*x;
-  REG(f.n) = REG(f.h) = 0;
-  REG(f.c) = get_bit(*x, 7);
+  shifted(cpu, *x, get_bit(*x, 7));
 }
 static void shift_right_logical(struct cpu* const cpu, uint8_t* const x) {
   const uint8_t carry = get_bit(*x, 0);
   *x >>= 1;
-  REG(f.z) = !*x;
-  REG(f.n) = REG(f.h) = 0;
-  REG(f.c) = carry;
+  shifted(cpu, *x, carry);
 }
 static void shift_left_arithmetic(struct cpu* const cpu, uint8_t* const x) {
   const uint8_t carry = get_bit(*x, 7);
   *x <<= 1;
-  REG(f.z) = !*x;
-  REG(f.n) = REG(f.h) = 0;
-  REG(f.c) = carry;
+  shifted(cpu, *x, carry);
 }
 static void shift_right_arithmetic(struct cpu* const cpu, uint8_t* const x) {
   const uint8_t carry = get_bit(*x, 0);
   *x = ((int8_t)*x) >> 1;
-  REG(f.z) = !*x;
-  REG(f.n) = REG(f.h) = 0;
-  REG(f.c) = carry;
+  shifted(cpu, *x, carry);
 }
 
 // SUB/SBC should reassign result, CP should not
 static uint8_t subtract(struct cpu* const cpu, const uint8_t x, const uint8_t carry) {
   assert(carry == 0 || carry == 1);
   const uint16_t diff = REG(a) - x - carry;
-  const uint16_t half = (REG(a) & 0x0F) - (x & 0x0F) - carry;
-  REG(f.z) = ((uint8_t)diff) == 0;
-  REG(f.n) = 1;
-  REG(f.c) = diff > 0xFF;
-  REG(f.h) = half > 0x0F;
+  SET_FLAGS(kFlagsSub, REG(a), x, carry, diff, {
+    const uint16_t half = (REG(a) & 0x0F) - (x & 0x0F) - carry;
+    REG(f.z) = ((uint8_t)diff) == 0;
+    REG(f.n) = 1;
+    REG(f.c) = diff > 0xFF;
+    REG(f.h) = half > 0x0F;
+  });
   return (uint8_t)diff;
 }
 static void swap(struct cpu* const cpu, uint8_t* const x) {
   *x = (*x << 4) | (*x >> 4);
-  REG(f.z) = !*x;
-  REG(f.n) = REG(f.c) = REG(f.h) = 0;
+  shifted(cpu, *x, 0);
 }
 static void add(struct cpu* const cpu, const uint8_t x, const uint8_t carry) {
   assert(carry == 0 || carry == 1);
   const uint16_t sum = REG(a) + x + carry;
-  const uint8_t y = (REG(a) & 0x0F) + (x & 0x0F) + carry;
+  SET_FLAGS(kFlagsAdd, REG(a), x, carry, sum, {
+    const uint8_t y = (REG(a) & 0x0F) + (x & 0x0F) + carry;
+    REG(f.z) = !(uint8_t)sum;
+    REG(f.n) = 0;
+    REG(f.c) = sum > 0xFF;
+    REG(f.h) = y > 0x0F;
+  });
   REG(a) = (uint8_t)sum;
-  REG(f.z) = !REG(a);
-  REG(f.n) = 0;
-  REG(f.c) = sum > 0xFF;
-  REG(f.h) = y > 0x0F;
 }
 static void add16(struct cpu* const cpu, uint16_t* const a, const uint16_t b) {
   cpu->tick_cycles += 4;
+  SYNC_FLAGS();
   const uint32_t x = *a + b;
   const uint32_t y = (*a & 0x0FFFU) + (b & 0x0FFFU);
   REG(f.n) = 0;
@@ -249,26 +401,107 @@ static void add16(struct cpu* const cpu, uint16_t* const a, const uint16_t b) {
   *a = (uint16_t)x;
 }
 
-static void alu_tick_once(struct cpu* const cpu) {
-#ifndef NDEBUG
-  const uint16_t pre_op_pc = REG(pc);
-#endif
-  cpu->tick_cycles = 0;
-  const uint8_t op = fetch_byte(cpu);
+// Stays within the current block while execution falls through it, only
+// going back to the cache after a jump or once the block runs out.
+static const struct decoded_op* next_op(struct cpu* const cpu) {
+  const struct block* block = cpu->block;
+  if (!block || !block->valid || cpu->block_pos >= block->count ||
+      block->ops[cpu->block_pos].pc != REG(pc)) {
+    block = cpu->block = get_block(cpu->blocks, cpu->mmu, REG(pc));
+    cpu->block_pos = 0;
+  }
+  return &block->ops[cpu->block_pos++];
+}
+
+void execute_op(struct cpu* const cpu, const struct decoded_op* const decoded) {
+  const uint16_t pre_op_sp = REG(sp);
+  cpu->tick_cycles = decoded->cycles;
+  cpu->imm = decoded->imm;
+  ++REG(pc);
+  const uint8_t op = decoded->op;
 
   LOG(5, "== " PRIbyte " @ " PRIshort "\n", op, (uint16_t)(REG(pc) - 1));
 
+#ifdef USE_COMPUTED_GOTO
+  static const void* const ops [256] = {
+    &&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03,
+    &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,
+    &&op_0x08, &&op_0x09, &&op_0x0A, &&op_0x0B,
+    &&op_0x0C, &&op_0x0D, &&op_0x0E, &&op_0x0F,
+    &&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13,
+    &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,
+    &&op_0x18, &&op_0x19, &&op_0x1A, &&op_0x1B,
+    &&op_0x1C, &&op_0x1D, &&op_0x1E, &&op_0x1F,
+    &&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23,
+    &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,
+    &&op_0x28, &&op_0x29, &&op_0x2A, &&op_0x2B,
+    &&op_0x2C, &&op_0x2D, &&op_0x2E, &&op_0x2F,
+    &&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33,
+    &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,
+    &&op_0x38, &&op_0x39, &&op_0x3A, &&op_0x3B,
+    &&op_0x3C, &&op_0x3D, &&op_0x3E, &&op_0x3F,
+    &&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43,
+    &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,
+    &&op_0x48, &&op_0x49, &&op_0x4A, &&op_0x4B,
+    &&op_0x4C, &&op_0x4D, &&op_0x4E, &&op_0x4F,
+    &&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53,
+    &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,
+    &&op_0x58, &&op_0x59, &&op_0x5A, &&op_0x5B,
+    &&op_0x5C, &&op_0x5D, &&op_0x5E, &&op_0x5F,
+    &&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63,
+    &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67,
+    &&op_0x68, &&op_0x69, &&op_0x6A, &&op_0x6B,
+    &&op_0x6C, &&op_0x6D, &&op_0x6E, &&op_0x6F,
+    &&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73,
+    &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,
+    &&op_0x78, &&op_0x79, &&op_0x7A, &&op_0x7B,
+    &&op_0x7C, &&op_0x7D, &&op_0x7E, &&op_0x7F,
+    &&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83,
+    &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,
+    &&op_0x88, &&op_0x89, &&op_0x8A, &&op_0x8B,
+    &&op_0x8C, &&op_0x8D, &&op_0x8E, &&op_0x8F,
+    &&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93,
+    &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,
+    &&op_0x98, &&op_0x99, &&op_0x9A, &&op_0x9B,
+    &&op_0x9C, &&op_0x9D, &&op_0x9E, &&op_0x9F,
+    &&op_0xA0, &&op_0xA1, &&op_0xA2, &&op_0xA3,
+    &&op_0xA4, &&op_0xA5, &&op_0xA6, &&op_0xA7,
+    &&op_0xA8, &&op_0xA9, &&op_0xAA, &&op_0xAB,
+    &&op_0xAC, &&op_0xAD, &&op_0xAE, &&op_0xAF,
+    &&op_0xB0, &&op_0xB1, &&op_0xB2, &&op_0xB3,
+    &&op_0xB4, &&op_0xB5, &&op_0xB6, &&op_0xB7,
+    &&op_0xB8, &&op_0xB9, &&op_0xBA, &&op_0xBB,
+    &&op_0xBC, &&op_0xBD, &&op_0xBE, &&op_0xBF,
+    &&op_0xC0, &&op_0xC1, &&op_0xC2, &&op_0xC3,
+    &&op_0xC4, &&op_0xC5, &&op_0xC6, &&op_0xC7,
+    &&op_0xC8, &&op_0xC9, &&op_0xCA, &&op_0xCB,
+    &&op_0xCC, &&op_0xCD, &&op_0xCE, &&op_0xCF,
+    &&op_0xD0, &&op_0xD1, &&op_0xD2, &&unhandled,
+    &&op_0xD4, &&op_0xD5, &&op_0xD6, &&op_0xD7,
+    &&op_0xD8, &&op_0xD9, &&op_0xDA, &&unhandled,
+    &&op_0xDC, &&unhandled, &&op_0xDE, &&op_0xDF,
+    &&op_0xE0, &&op_0xE1, &&op_0xE2, &&unhandled,
+    &&unhandled, &&op_0xE5, &&op_0xE6, &&op_0xE7,
+    &&op_0xE8, &&op_0xE9, &&op_0xEA, &&unhandled,
+    &&unhandled, &&unhandled, &&op_0xEE, &&op_0xEF,
+    &&op_0xF0, &&op_0xF1, &&op_0xF2, &&op_0xF3,
+    &&unhandled, &&op_0xF5, &&op_0xF6, &&op_0xF7,
+    &&op_0xF8, &&op_0xF9, &&op_0xFA, &&op_0xFB,
+    &&unhandled, &&unhandled, &&op_0xFE, &&op_0xFF,
+  };
+#endif
+
   // TODO: check for interrupts
-  switch (op) {
+  DISPATCH(ops, op) {
     CASE(0x00, {}) // NOP
     CASE(0x01, { REG(bc) = fetch_word(cpu); }) // LD BC,d16
     CASE(0x02, { deref_store(cpu, REG(bc), REG(a)); }) // LD (BC),A
-    CASE(0x2F, { REG(a) = ~REG(a); REG(f.n) = REG(f.h) = 1; }) // CPL
+    CASE(0x2F, { REG(a) = ~REG(a); SYNC_FLAGS(); REG(f.n) = REG(f.h) = 1; }) // CPL
     CASE(0x03, { inc16(cpu, &REG(bc)); }) // INC BC
     CASE(0x04, { inc(cpu, &REG(b)); }) // INC B
     CASE(0x05, { dec(cpu, &REG(b)); }) // DEC B
     CASE(0x06, { REG(b) = fetch_byte(cpu); }) // LD B,d8
-    CASE(0x07, { rotate_left_c(cpu, &REG(a)); REG(f.z) = 0; }) // RLCA
+    CASE(0x07, { rotate_left_c(cpu, &REG(a)); SYNC_FLAGS(); REG(f.z) = 0; }) // RLCA
     CASE(0x08, { deref_store_word(cpu, fetch_word(cpu), REG(sp)); }) // LD (a16),SP
     CASE(0x09, { add16(cpu, &REG(hl), REG(bc)); }) // ADD HL,BC
     CASE(0x0A, { REG(a) = deref_load(cpu, REG(bc)); }) // LD A,(BC)
@@ -276,14 +509,15 @@ static void alu_tick_once(struct cpu* const cpu) {
     CASE(0x0C, { inc(cpu, &REG(c)); }) // INC C
     CASE(0x0D, { dec(cpu, &REG(c)); }) // DEC C
     CASE(0x0E, { REG(c) = fetch_byte(cpu); }) // LD C,d8
-    CASE(0x0F, { rotate_right_c(cpu, &REG(a)); REG(f.z) = 0; }) // RRCA
+    CASE(0x0F, { rotate_right_c(cpu, &REG(a)); SYNC_FLAGS(); REG(f.z) = 0; }) // RRCA
+    CASE(0x10, { stop(cpu); }) // STOP 0
     CASE(0x11, { REG(de) = fetch_word(cpu); }) // LD DE,d16
     CASE(0x12, { deref_store(cpu, REG(de), REG(a)); }) // LD (DE),A
     CASE(0x13, { inc16(cpu, &REG(de)); }) // INC DE
     CASE(0x14, { inc(cpu, &REG(d)); }) // INC D
     CASE(0x15, { dec(cpu, &REG(d)); }) // DEC D
     CASE(0x16, { REG(d) = fetch_byte(cpu); }) // LD D,d8
-    CASE(0x17, { rotate_left(cpu, &REG(a)); REG(f.z) = 0; }) // RLA
+    CASE(0x17, { rotate_left(cpu, &REG(a)); SYNC_FLAGS(); REG(f.z) = 0; }) // RLA
     CASE(0x18, { conditional_jump_relative(cpu, 1); }) // JR r8
     CASE(0x19, { add16(cpu, &REG(hl), REG(de)); }) // ADD HL,DE
     CASE(0x1A, { REG(a) = deref_load(cpu, REG(de)); }) // LD A,(DE)
@@ -291,8 +525,8 @@ static void alu_tick_once(struct cpu* const cpu) {
     CASE(0x1C, { inc(cpu, &REG(e)); }) // INC E
     CASE(0x1D, { dec(cpu, &REG(e)); }) // DEC E
     CASE(0x1E, { REG(e) = fetch_byte(cpu); }) // LD E,d8
-    CASE(0x1F, { rotate_right(cpu, &REG(a)); REG(f.z) = 0; }) // RRA
-    CASE(0x20, { conditional_jump_relative(cpu, !REG(f.z)); }) // JR NZ,r8
+    CASE(0x1F, { rotate_right(cpu, &REG(a)); SYNC_FLAGS(); REG(f.z) = 0; }) // RRA
+    CASE(0x20, { conditional_jump_relative(cpu, !FLAG(z)); }) // JR NZ,r8
     CASE(0x21, { REG(hl) = fetch_word(cpu); }) // LD HL,d16
     CASE(0x22, { deref_store(cpu, REG(hl)++, REG(a)); }) // LD (HL+),A
     CASE(0x23, { inc16(cpu, &REG(hl)); }) // INC HL
@@ -300,6 +534,7 @@ static void alu_tick_once(struct cpu* const cpu) {
     CASE(0x25, { dec(cpu, &REG(h)); }) // DEC H
     CASE(0x26, { REG(h) = fetch_byte(cpu); }) // LD H,d8
     CASE(0x27, {
+      SYNC_FLAGS();
       if (REG(f.n)) {
         if (REG(f.h)) {
           REG(a) += 0xFA;
@@ -323,29 +558,29 @@ static void alu_tick_once(struct cpu* const cpu) {
       REG(f.h) = 0;
       REG(f.z) = !REG(a);
     }) // DAA
-    CASE(0x28, { conditional_jump_relative(cpu, REG(f.z)); }) // JR Z,r8
+    CASE(0x28, { conditional_jump_relative(cpu, FLAG(z)); }) // JR Z,r8
     CASE(0x29, { add16(cpu, &REG(hl), REG(hl)); }) // ADD HL,HL
     CASE(0x2A, { REG(a) = deref_load(cpu, REG(hl)++); }) // LD A,(HL+)
     CASE(0x2B, { dec16(cpu, &REG(hl)); }) // DEC HL
     CASE(0x2C, { inc(cpu, &REG(l)); }) // INC L
     CASE(0x2D, { dec(cpu, &REG(l)); }) // DEC L
     CASE(0x2E, { REG(l) = fetch_byte(cpu); }) // LD L,d8
-    CASE(0x30, { conditional_jump_relative(cpu, !REG(f.c)); }) // JR NC,r8
+    CASE(0x30, { conditional_jump_relative(cpu, !FLAG(c)); }) // JR NC,r8
     CASE(0x31, { REG(sp) = fetch_word(cpu); }) // LD SP,d16
     CASE(0x32, { deref_store(cpu, REG(hl)--, REG(a)); }) // LD (HL-),A
     CASE(0x33, { inc16(cpu, &REG(sp)); }) // INC SP
     CASE(0x34, { DEREF_DECORATOR(REG(hl), { inc(cpu, &x); }) }) // INC (HL)
     CASE(0x35, { DEREF_DECORATOR(REG(hl), { dec(cpu, &x); }) }) // DEC (HL)
     CASE(0x36, { deref_store(cpu, REG(hl), fetch_byte(cpu)); }) // LD (HL),d8
-    CASE(0x37, { REG(f.c) = 1; REG(f.n) = REG(f.h) = 0; }) // SCF
-    CASE(0x38, { conditional_jump_relative(cpu, REG(f.c)); }) // JR C,r8
+    CASE(0x37, { SYNC_FLAGS(); REG(f.c) = 1; REG(f.n) = REG(f.h) = 0; }) // SCF
+    CASE(0x38, { conditional_jump_relative(cpu, FLAG(c)); }) // JR C,r8
     CASE(0x39, { add16(cpu, &REG(hl), REG(sp)); }) // ADD HL,SP
     CASE(0x3A, { REG(a) = deref_load(cpu, REG(hl)--); }) // LD A,(HL-)
     CASE(0x3B, { dec16(cpu, &REG(sp)); }) // DEC SP
     CASE(0x3C, { inc(cpu, &REG(a)); }) // INC A
     CASE(0x3D, { dec(cpu, &REG(a)); }) // DEC A
     CASE(0x3E, { REG(a) = fetch_byte(cpu); }) // LD A,d8
-    CASE(0x3F, { REG(f.c) = !REG(f.c); REG(f.n) = REG(f.h) = 0; }) // CCF
+    CASE(0x3F, { SYNC_FLAGS(); REG(f.c) = !REG(f.c); REG(f.n) = REG(f.h) = 0; }) // CCF
     CASE(0x40, { REG(b) = REG(b); }) // LD B,B
     CASE(0x41, { REG(b) = REG(c); }) // LD B,C
     CASE(0x42, { REG(b) = REG(d); }) // LD B,D
@@ -400,6 +635,7 @@ static void alu_tick_once(struct cpu* const cpu) {
     CASE(0x73, { deref_store(cpu, REG(hl), REG(e)); }) // LD (HL),E
     CASE(0x74, { deref_store(cpu, REG(hl), REG(h)); }) // LD (HL),H
     CASE(0x75, { deref_store(cpu, REG(hl), REG(l)); }) // LD (HL),L
+    CASE(0x76, { halt(cpu); }) // HALT
     CASE(0x77, { deref_store(cpu, REG(hl), REG(a)); }) // LD (HL),A
     CASE(0x78, { REG(a) = REG(b); }) // LD A,B
     CASE(0x79, { REG(a) = REG(c); }) // LD A,C
@@ -417,14 +653,14 @@ static void alu_tick_once(struct cpu* const cpu) {
     CASE(0x85, { add(cpu, REG(l), 0); }) // ADD L
     CASE(0x86, { add(cpu, deref_load(cpu, REG(hl)), 0); }) // ADD (HL)
     CASE(0x87, { add(cpu, REG(a), 0); }) // ADD A
-    CASE(0x88, { add(cpu, REG(b), REG(f.c)); }) // ADC B
-    CASE(0x89, { add(cpu, REG(c), REG(f.c)); }) // ADC C
-    CASE(0x8A, { add(cpu, REG(d), REG(f.c)); }) // ADC D
-    CASE(0x8B, { add(cpu, REG(e), REG(f.c)); }) // ADC E
-    CASE(0x8C, { add(cpu, REG(h), REG(f.c)); }) // ADC H
-    CASE(0x8D, { add(cpu, REG(l), REG(f.c)); }) // ADC L
-    CASE(0x8E, { add(cpu, deref_load(cpu, REG(hl)), REG(f.c)); }) // ADC (HL)
-    CASE(0x8F, { add(cpu, REG(a), REG(f.c)); }) // ADC A
+    CASE(0x88, { add(cpu, REG(b), FLAG(c)); }) // ADC B
+    CASE(0x89, { add(cpu, REG(c), FLAG(c)); }) // ADC C
+    CASE(0x8A, { add(cpu, REG(d), FLAG(c)); }) // ADC D
+    CASE(0x8B, { add(cpu, REG(e), FLAG(c)); }) // ADC E
+    CASE(0x8C, { add(cpu, REG(h), FLAG(c)); }) // ADC H
+    CASE(0x8D, { add(cpu, REG(l), FLAG(c)); }) // ADC L
+    CASE(0x8E, { add(cpu, deref_load(cpu, REG(hl)), FLAG(c)); }) // ADC (HL)
+    CASE(0x8F, { add(cpu, REG(a), FLAG(c)); }) // ADC A
     CASE(0x90, { REG(a) = subtract(cpu, REG(b), 0); }) // SUB B
     CASE(0x91, { REG(a) = subtract(cpu, REG(c), 0); }) // SUB C
     CASE(0x92, { REG(a) = subtract(cpu, REG(d), 0); }) // SUB D
@@ -433,14 +669,14 @@ static void alu_tick_once(struct cpu* const cpu) {
     CASE(0x95, { REG(a) = subtract(cpu, REG(l), 0); }) // SUB L
     CASE(0x96, { REG(a) = subtract(cpu, deref_load(cpu, REG(hl)), 0); }) // SUB (HL)
     CASE(0x97, { REG(a) = subtract(cpu, REG(a), 0); }) // SUB A
-    CASE(0x98, { REG(a) = subtract(cpu, REG(b), REG(f.c)); }) // SBC B
-    CASE(0x99, { REG(a) = subtract(cpu, REG(c), REG(f.c)); }) // SBC C
-    CASE(0x9A, { REG(a) = subtract(cpu, REG(d), REG(f.c)); }) // SBC D
-    CASE(0x9B, { REG(a) = subtract(cpu, REG(e), REG(f.c)); }) // SBC E
-    CASE(0x9C, { REG(a) = subtract(cpu, REG(h), REG(f.c)); }) // SBC H
-    CASE(0x9D, { REG(a) = subtract(cpu, REG(l), REG(f.c)); }) // SBC L
-    CASE(0x9E, { REG(a) = subtract(cpu, deref_load(cpu, REG(hl)), REG(f.c)); }) // SBC (HL)
-    CASE(0x9F, { REG(a) = subtract(cpu, REG(a), REG(f.c)); }) // SBC A
+    CASE(0x98, { REG(a) = subtract(cpu, REG(b), FLAG(c)); }) // SBC B
+    CASE(0x99, { REG(a) = subtract(cpu, REG(c), FLAG(c)); }) // SBC C
+    CASE(0x9A, { REG(a) = subtract(cpu, REG(d), FLAG(c)); }) // SBC D
+    CASE(0x9B, { REG(a) = subtract(cpu, REG(e), FLAG(c)); }) // SBC E
+    CASE(0x9C, { REG(a) = subtract(cpu, REG(h), FLAG(c)); }) // SBC H
+    CASE(0x9D, { REG(a) = subtract(cpu, REG(l), FLAG(c)); }) // SBC L
+    CASE(0x9E, { REG(a) = subtract(cpu, deref_load(cpu, REG(hl)), FLAG(c)); }) // SBC (HL)
+    CASE(0x9F, { REG(a) = subtract(cpu, REG(a), FLAG(c)); }) // SBC A
     CASE(0xA0, { and(cpu, REG(b)); }) // AND B
     CASE(0xA1, { and(cpu, REG(c)); }) // AND C
     CASE(0xA2, { and(cpu, REG(d)); }) // AND D
@@ -473,11 +709,11 @@ static void alu_tick_once(struct cpu* const cpu) {
     CASE(0xBD, { subtract(cpu, REG(l), 0); }) // CP L
     CASE(0xBE, { subtract(cpu, deref_load(cpu, REG(hl)), 0); }) // CP (HL)
     CASE(0xBF, { subtract(cpu, REG(a), 0); }) // CP A
-    CASE(0xC0, { ret(cpu, !REG(f.z)); }); // RET NZ
+    CASE(0xC0, { ret(cpu, !FLAG(z)); }); // RET NZ
     CASE(0xC1, { REG(bc) = pop(cpu); }) // POP BC
-    CASE(0xC2, { conditional_jump(cpu, fetch_word(cpu), !REG(f.z)); }) // JP NZ,a16
+    CASE(0xC2, { conditional_jump(cpu, fetch_word(cpu), !FLAG(z)); }) // JP NZ,a16
     CASE(0xC3, { jump(cpu, fetch_word(cpu)); }) // JP a16
-    CASE(0xC4, { call(cpu, !REG(f.z)); }) // CALL NZ,a16
+    CASE(0xC4, { call(cpu, !FLAG(z)); }) // CALL NZ,a16
     CASE(0xC5, {
       push(cpu, REG(bc));
       // This is weird
@@ -485,20 +721,20 @@ static void alu_tick_once(struct cpu* const cpu) {
     }) // PUSH BC
     CASE(0xC6, { add(cpu, fetch_byte(cpu), 0); }) // ADD d8
     CASE(0xC7, { rst(cpu, 0x00); }) // RST 0x00
-    CASE(0xC8, { ret(cpu, REG(f.z)); }) // RET Z
+    CASE(0xC8, { ret(cpu, FLAG(z)); }) // RET Z
     // TODO: this would be faster...
     /*CASE(0xC9, { jump(cpu, pop(cpu)); }) // RET*/
     CASE(0xC9, { ret(cpu, 1); }) // RET
-    CASE(0xCA, { conditional_jump(cpu, fetch_word(cpu), REG(f.z)); }) // JP Z,a16
+    CASE(0xCA, { conditional_jump(cpu, fetch_word(cpu), FLAG(z)); }) // JP Z,a16
     CASE(0xCB, { cb(cpu); }) // CB prefix
-    CASE(0xCC, { call(cpu, REG(f.z)); }) // CALL Z,a16
+    CASE(0xCC, { call(cpu, FLAG(z)); }) // CALL Z,a16
     CASE(0xCD, { call(cpu, 1); }) // CALL a16
-    CASE(0xCE, { add(cpu, fetch_byte(cpu), REG(f.c)); }) // ADC d8
+    CASE(0xCE, { add(cpu, fetch_byte(cpu), FLAG(c)); }) // ADC d8
     CASE(0xCF, { rst(cpu, 0x08); }) // RST 0x00
-    CASE(0xD0, { ret(cpu, !REG(f.c)); }) // RET NC
+    CASE(0xD0, { ret(cpu, !FLAG(c)); }) // RET NC
     CASE(0xD1, { REG(de) = pop(cpu); }) // POP DE
-    CASE(0xD2, { conditional_jump(cpu, fetch_word(cpu), !REG(f.c)); }) // JP NC,a16
-    CASE(0xD4, { call(cpu, !REG(f.c)); }) // CALL NC,a16
+    CASE(0xD2, { conditional_jump(cpu, fetch_word(cpu), !FLAG(c)); }) // JP NC,a16
+    CASE(0xD4, { call(cpu, !FLAG(c)); }) // CALL NC,a16
     CASE(0xD5, {
       push(cpu, REG(de));
       // This is weird
@@ -506,16 +742,17 @@ static void alu_tick_once(struct cpu* const cpu) {
     }) // PUSH DE
     CASE(0xD6, { REG(a) = subtract(cpu, fetch_byte(cpu), 0); }) // SUB d8
     CASE(0xD7, { rst(cpu, 0x10); }) // RST 0x10
-    CASE(0xD8, { ret(cpu, REG(f.c)); }) // RET C
+    CASE(0xD8, { ret(cpu, FLAG(c)); }) // RET C
     CASE(0xD9, {
       cpu->interrupts_enabled = 1;
+      schedule_interrupt_check(cpu->mmu->scheduler);
       // TODO: this would be faster...
       /*jump(cpu, pop(cpu));*/
       ret(cpu, 1);
     }) // RETI
-    CASE(0xDA, { conditional_jump(cpu, fetch_word(cpu), REG(f.c)); }) // JP C,a16
-    CASE(0xDC, { call(cpu, REG(f.c)); }) // CALL C,a16
-    CASE(0xDE, { REG(a) = subtract(cpu, fetch_byte(cpu), REG(f.c)); }) // SBC d8
+    CASE(0xDA, { conditional_jump(cpu, fetch_word(cpu), FLAG(c)); }) // JP C,a16
+    CASE(0xDC, { call(cpu, FLAG(c)); }) // CALL C,a16
+    CASE(0xDE, { REG(a) = subtract(cpu, fetch_byte(cpu), FLAG(c)); }) // SBC d8
     CASE(0xDF, { rst(cpu, 0x18); }) // RST 0x18
     CASE(0xE0, { deref_store(cpu, 0xFF00 | fetch_byte(cpu), REG(a)); }) // LDH (a8),A
     CASE(0xE1, { REG(hl) = pop(cpu); }) // POP HL
@@ -529,6 +766,7 @@ static void alu_tick_once(struct cpu* const cpu) {
     CASE(0xE7, { rst(cpu, 0x20); }) // RST 0x20
     CASE(0xE8, {
       const int8_t r8 = (int8_t)fetch_byte(cpu);
+      SYNC_FLAGS();
       REG(f.z) = REG(f.n) = 0;
       REG(f.c) = (REG(sp) & 0xFF) + ((uint8_t)r8) > 0xFF;
       REG(f.h) = (REG(sp) & 0x0F) + (((uint8_t)r8) & 0x0F) > 0x0F;
@@ -541,10 +779,11 @@ static void alu_tick_once(struct cpu* const cpu) {
     CASE(0xEF, { rst(cpu, 0x28); }) // RST 0x28
     CASE(0xF0, { REG(a) = deref_load(cpu, 0xFF00 | fetch_byte(cpu)); }) // LDH A,(a8)
     // Does not update padding!
-    CASE(0xF1, { REG(af) = pop(cpu) & 0xFFF0; }) // POP AF
+    CASE(0xF1, { SYNC_FLAGS(); REG(af) = pop(cpu) & 0xFFF0; }) // POP AF
     CASE(0xF2, { REG(a) = deref_load(cpu, 0xFF00 | REG(c)); }) // LD A,(C)
     CASE(0xF3, { cpu->interrupts_enabled = 0; }) // DI
     CASE(0xF5, {
+      SYNC_FLAGS();
       push(cpu, REG(af));
       // This is weird
       cpu->tick_cycles += 4;
@@ -553,6 +792,7 @@ static void alu_tick_once(struct cpu* const cpu) {
     CASE(0xF7, { rst(cpu, 0x30); }) // RST 0x30
     CASE(0xF8, {
       const int8_t r8 = (int8_t)fetch_byte(cpu);
+      SYNC_FLAGS();
       REG(f.z) = REG(f.n) = 0;
       REG(f.c) = (REG(sp) & 0xFF) + ((uint8_t)r8) > 0xFF;
       REG(f.h) = (REG(sp) & 0x0F) + (((uint8_t)r8) & 0x0F) > 0x0F;
@@ -562,24 +802,104 @@ static void alu_tick_once(struct cpu* const cpu) {
     CASE(0xF9, { REG(sp) = REG(hl); cpu->tick_cycles += 4; }) // LD SP,HL
     CASE(0xFA, { REG(a) = deref_load(cpu, fetch_word(cpu)); }) // LD A,(a16)
     // TODO: I think this gets enabled after one more inst?
-    CASE(0xFB, { cpu->interrupts_enabled = 1; }) // EI
+    CASE(0xFB, {
+      cpu->interrupts_enabled = 1;
+      schedule_interrupt_check(cpu->mmu->scheduler);
+    }) // EI
     CASE(0xFE, { subtract(cpu, fetch_byte(cpu), 0); }) // CP d8
     CASE(0xFF, { rst(cpu, 0x38); }) // RST 0x38
-    default:
+    DEFAULT({
       fprintf(stderr, "Unhandled opcode: " PRIbyte "\n", op);
       exit(EXIT_FAILURE);
-      break;
+    })
+  }
+
+  // Jumping to itself, nothing changes until an interrupt is taken.  A CALL or
+  // RST to itself pushes every time round, so that one has to keep stepping.
+  if (REG(pc) == decoded->pc && REG(sp) == pre_op_sp) {
+    cpu->state = kSpinning;
   }
 
   assert(cpu->tick_cycles >= 4);
   assert(cpu->tick_cycles <= 24);
-  assert(pre_op_pc != REG(pc));  // Infinite loop detected
+}
+
+static void alu_tick_once(struct cpu* const cpu) {
+  execute_op(cpu, next_op(cpu));
 }
 
 static void cb(struct cpu* const cpu) {
   cpu->tick_cycles += 4;
   const uint8_t op = fetch_byte(cpu);
-  switch (op) {
+#ifdef USE_COMPUTED_GOTO
+  static const void* const cb_ops [256] = {
+    &&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03,
+    &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,
+    &&op_0x08, &&op_0x09, &&op_0x0A, &&op_0x0B,
+    &&op_0x0C, &&op_0x0D, &&op_0x0E, &&op_0x0F,
+    &&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13,
+    &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,
+    &&op_0x18, &&op_0x19, &&op_0x1A, &&op_0x1B,
+    &&op_0x1C, &&op_0x1D, &&op_0x1E, &&op_0x1F,
+    &&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23,
+    &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,
+    &&op_0x28, &&op_0x29, &&op_0x2A, &&op_0x2B,
+    &&op_0x2C, &&op_0x2D, &&op_0x2E, &&op_0x2F,
+    &&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33,
+    &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,
+    &&op_0x38, &&op_0x39, &&op_0x3A, &&op_0x3B,
+    &&op_0x3C, &&op_0x3D, &&op_0x3E, &&op_0x3F,
+    &&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43,
+    &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,
+    &&op_0x48, &&op_0x49, &&op_0x4A, &&op_0x4B,
+    &&op_0x4C, &&op_0x4D, &&op_0x4E, &&op_0x4F,
+    &&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53,
+    &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,
+    &&op_0x58, &&op_0x59, &&op_0x5A, &&op_0x5B,
+    &&op_0x5C, &&op_0x5D, &&op_0x5E, &&op_0x5F,
+    &&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63,
+    &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67,
+    &&op_0x68, &&op_0x69, &&op_0x6A, &&op_0x6B,
+    &&op_0x6C, &&op_0x6D, &&op_0x6E, &&op_0x6F,
+    &&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73,
+    &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,
+    &&op_0x78, &&op_0x79, &&op_0x7A, &&op_0x7B,
+    &&op_0x7C, &&op_0x7D, &&op_0x7E, &&op_0x7F,
+    &&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83,
+    &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,
+    &&op_0x88, &&op_0x89, &&op_0x8A, &&op_0x8B,
+    &&op_0x8C, &&op_0x8D, &&op_0x8E, &&op_0x8F,
+    &&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93,
+    &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,
+    &&op_0x98, &&op_0x99, &&op_0x9A, &&op_0x9B,
+    &&op_0x9C, &&op_0x9D, &&op_0x9E, &&op_0x9F,
+    &&op_0xA0, &&op_0xA1, &&op_0xA2, &&op_0xA3,
+    &&op_0xA4, &&op_0xA5, &&op_0xA6, &&op_0xA7,
+    &&op_0xA8, &&op_0xA9, &&op_0xAA, &&op_0xAB,
+    &&op_0xAC, &&op_0xAD, &&op_0xAE, &&op_0xAF,
+    &&op_0xB0, &&op_0xB1, &&op_0xB2, &&op_0xB3,
+    &&op_0xB4, &&op_0xB5, &&op_0xB6, &&op_0xB7,
+    &&op_0xB8, &&op_0xB9, &&op_0xBA, &&op_0xBB,
+    &&op_0xBC, &&op_0xBD, &&op_0xBE, &&op_0xBF,
+    &&op_0xC0, &&op_0xC1, &&op_0xC2, &&op_0xC3,
+    &&op_0xC4, &&op_0xC5, &&op_0xC6, &&op_0xC7,
+    &&op_0xC8, &&op_0xC9, &&op_0xCA, &&op_0xCB,
+    &&op_0xCC, &&op_0xCD, &&op_0xCE, &&op_0xCF,
+    &&op_0xD0, &&op_0xD1, &&op_0xD2, &&op_0xD3,
+    &&op_0xD4, &&op_0xD5, &&op_0xD6, &&op_0xD7,
+    &&op_0xD8, &&op_0xD9, &&op_0xDA, &&op_0xDB,
+    &&op_0xDC, &&op_0xDD, &&op_0xDE, &&op_0xDF,
+    &&op_0xE0, &&op_0xE1, &&op_0xE2, &&op_0xE3,
+    &&op_0xE4, &&op_0xE5, &&op_0xE6, &&op_0xE7,
+    &&op_0xE8, &&op_0xE9, &&op_0xEA, &&op_0xEB,
+    &&op_0xEC, &&op_0xED, &&op_0xEE, &&op_0xEF,
+    &&op_0xF0, &&op_0xF1, &&op_0xF2, &&op_0xF3,
+    &&op_0xF4, &&op_0xF5, &&op_0xF6, &&op_0xF7,
+    &&op_0xF8, &&op_0xF9, &&op_0xFA, &&op_0xFB,
+    &&op_0xFC, &&op_0xFD, &&op_0xFE, &&op_0xFF,
+  };
+#endif
+  DISPATCH(cb_ops, op) {
     CASE(0x00, { rotate_left_c(cpu, &REG(b)); }) // RLC B
     CASE(0x01, { rotate_left_c(cpu, &REG(c)); }) // RLC C
     CASE(0x02, { rotate_left_c(cpu, &REG(d)); }) // RLC D
@@ -836,17 +1156,14 @@ static void cb(struct cpu* const cpu) {
     CASE(0xFD, { set_bit(&REG(l), 7); }) // SET 7,L
     CASE(0xFE, { DEREF_DECORATOR(REG(hl), { set_bit(&x, 7); }) }) // SET 7,(HL)
     CASE(0xFF, { set_bit(&REG(a), 7); }) // SET 7,A
-    default:
+    DEFAULT({
       fprintf(stderr, "Unhandled 0xCB opcode: " PRIbyte "\n", op);
       exit(EXIT_FAILURE);
-      break;
+    })
   }
 }
 
-void handle_interrupts(struct cpu* const cpu) {
-  if (!cpu->interrupts_enabled) {
-    return;
-  }
+uint32_t handle_interrupts(struct cpu* const cpu) {
   // Interrupts enabled
   const uint8_t ie = rb(cpu->mmu, 0xFFFF);
   // Interrupts triggered
@@ -855,9 +1172,17 @@ void handle_interrupts(struct cpu* const cpu) {
 #ifndef NDEBUG
   // If they are just the poison value.
   if (ie == 0xF7 || i_f == 0xF7) {
-    return;
+    return 0;
   }
 #endif
+  // HALT and STOP end even if IME keeps the interrupt from being taken.
+  if ((cpu->state == kHalted && (ie & i_f)) ||
+      (cpu->state == kStopped && (i_f & 0x10))) {
+    cpu->state = kRunning;
+  }
+  if (!cpu->interrupts_enabled || !(ie & i_f)) {
+    return 0;
+  }
   assert(ie <= 0x1F);
   assert(i_f <= 0x1F);
 
@@ -866,24 +1191,36 @@ void handle_interrupts(struct cpu* const cpu) {
   // bit 2: 0x50 timer
   // bit 3: 0x58 serial
   // bit 4: 0x60 joypad
-  while (ie & i_f) {
-    LOG(7, "interrupt detected: " PRIbyte "\n", ie & i_f);
-    cpu->interrupts_enabled = 0;
-    const int tz = __builtin_ctz(ie & i_f);
-    reset_bit(&i_f, tz);
-    wb(cpu->mmu, 0xFF0F, i_f);
-    push(cpu, REG(pc));
-    REG(pc) = 8 * tz + 0x40;
-  }
+  // Only the highest priority one is taken; clearing IME holds off the rest.
+  LOG(7, "interrupt detected: " PRIbyte "\n", ie & i_f);
+  cpu->interrupts_enabled = 0;
+  cpu->state = kRunning;
+  const int tz = __builtin_ctz(ie & i_f);
+  reset_bit(&i_f, tz);
+  wb(cpu->mmu, 0xFF0F, i_f);
+  push(cpu, REG(pc));
+  REG(pc) = 8 * tz + 0x40;
+  return INTERRUPT_CYCLES;
 }
 
-void init_cpu(struct cpu* const cpu, struct mmu* const mmu) {
+// Returns 0 on success
+int init_cpu(struct cpu* const cpu, struct mmu* const mmu) {
   assert(cpu != NULL);
   assert(mmu != NULL);
   cpu->mmu = mmu;
+  cpu->blocks = create_block_cache();
+  if (!cpu->blocks) return -1;
+  cpu->block = NULL;
+  mmu->blocks = cpu->blocks;
+#ifdef USE_JIT
+  // Falls back to interpreting everything if this fails.
+  cpu->jit = create_jit(cpu);
+#else
+  cpu->jit = NULL;
+#endif
   // Don't jump the pc forward if it looks like we might be running just the
   // BIOS.  mgba checks header magic and checksums to verify.
-  if (!mmu->has_bios && mmu->rom_size != 256) {
+  if (!mmu->has_bios && mmu->cart.file_size != 256) {
     // TODO: is this the correct value of F at the end of BIOS?
     // TODO: might games depend on which specific bits are which flags?
     // https://github.com/mgba-emu/mgba/blob/388ed07074163f135989838633eea8f1c8416023/src/gb/gb.c#L443
@@ -894,10 +1231,34 @@ void init_cpu(struct cpu* const cpu, struct mmu* const mmu) {
     REG(sp) = 0xFFFE;
     REG(pc) = 0x0100;
   }
+#ifdef USE_LAZY_FLAGS
+  cpu->lazy.kind = kFlagsSynced;
+#endif
   cpu->interrupts_enabled = 1;
+  cpu->state = kRunning;
+  return 0;
+}
+
+void deinit_cpu(struct cpu* const cpu) {
+  if (cpu->mmu) {
+    cpu->mmu->blocks = NULL;
+  }
+#ifdef USE_JIT
+  destroy_jit(cpu->jit);
+  cpu->jit = NULL;
+#endif
+  destroy_block_cache(cpu->blocks);
+  cpu->blocks = NULL;
+  cpu->block = NULL;
 }
 
-void tick_once(struct cpu* const cpu) {
+void tick_once(struct cpu* const cpu, const uint64_t end) {
+#ifdef USE_JIT
+  if (cpu->jit && jit_tick(cpu, end)) {
+    return;
+  }
+#else
+  (void)end;
+#endif
   alu_tick_once(cpu);
-  handle_interrupts(cpu);
 }
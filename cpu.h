@@ -4,6 +4,19 @@
 
 #include "mmu.h"
 
+// Which operation last set the flags, under USE_LAZY_FLAGS.
+enum __attribute__((packed)) FlagsKind {
+  kFlagsSynced, // the f bitfield is up to date
+  kFlagsAdd,
+  kFlagsSub,
+  kFlagsAnd,
+  kFlagsLogic, // OR, XOR
+  kFlagsInc,
+  kFlagsDec,
+  kFlagsShift, // rotates, shifts and SWAP; carry holds C
+  kFlagsBit, // lhs is the operand, rhs the bit index
+};
+
 struct cpu {
   struct registers {
     union {
@@ -46,13 +59,57 @@ struct cpu {
     uint16_t sp;
     uint16_t pc;
   } registers;
-  struct mmu* mmu;
-  uint8_t tick_cycles;
+  uint16_t tick_cycles;
   uint8_t interrupts_enabled; // IME
+  // Anything but kRunning lets the scheduler skip ahead to the next event.
+  enum __attribute__((packed)) CpuState {
+    kRunning,
+    kHalted, // HALT, until IE & IF
+    kStopped, // STOP, until a joypad interrupt is requested
+    kSpinning, // jumping to itself, until an interrupt is taken
+    kPolling, // in a polling loop, until the next event
+  } state;
+#ifdef USE_LAZY_FLAGS
+  // Operands and result of the last flag setting operation.  kind is a
+  // FlagsKind.
+  struct lazy_flags {
+    uint16_t result;
+    uint8_t lhs;
+    uint8_t rhs;
+    uint8_t carry;
+    uint8_t kind;
+  } lazy;
+#endif
+  // The block being executed, and the next instruction within it.
+  uint8_t block_pos;
+  const struct block* block;
+  // Immediates of the current instruction, consumed by fetch_byte.
+  const uint8_t* imm;
+  struct mmu* mmu;
+  struct block_cache* blocks;
+  struct jit* jit;
 };
 
+_Static_assert(sizeof(struct cpu) <= 64, "struct cpu should fit a cache line");
+
 typedef void (*instr) (struct cpu* const);
 
-void tick_once (struct cpu* const cpu);
-void init_cpu (struct cpu* const restrict cpu,
+struct decoded_op;
+
+// T-cycles taken to push the PC and jump to an interrupt vector.
+#define INTERRUPT_CYCLES 20
+
+// Runs one instruction, or a translated block up to the next event or end,
+// whichever comes first.  Interrupts are left to handle_interrupts, which the
+// scheduler calls when IME, IE or IF change; it returns the T-cycles spent
+// taking one, or 0 if none was taken.
+void tick_once (struct cpu* const cpu, const uint64_t end);
+uint32_t handle_interrupts (struct cpu* const cpu);
+// Brings the f bitfield (and so af) up to date under USE_LAZY_FLAGS.
+void sync_flags (struct cpu* const cpu);
+// Takes the f bitfield as the flags from here on, as after loading state.
+void reset_flags (struct cpu* const cpu);
+void execute_op (struct cpu* const cpu, const struct decoded_op* const decoded);
+int init_cpu (struct cpu* const restrict cpu,
     struct mmu* const restrict mmu);
+void deinit_cpu (struct cpu* const cpu);
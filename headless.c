@@ -0,0 +1,121 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pocketgb.h"
+
+static void usage (void) {
+  fprintf(stderr, "USAGE: ./pocketgb-headless [-n frames] [-s bytes] [-v] "
+      "[-o out.ppm] [-l in.state] [-w out.state] [bios.gb] <rom.gb>\n"
+      "  -n frames  stop after this many frames\n"
+      "  -s bytes   stop after the frame in which this many bytes have gone\n"
+      "             out over serial\n"
+      "  -v         stop once serial output says Passed or Failed, exiting\n"
+      "             with 0 or 1 respectively, or 2 if it never does\n"
+      "  -o file    write the last frame to file as a PPM\n"
+      "  -l file    load state from file before running\n"
+      "  -w file    save state to file after running\n"
+      "At least one of -n, -s and -v is needed.  Serial output is written to\n"
+      "stdout on exit, and battery RAM is never saved.\n");
+}
+
+// Returns 0 on success
+static int write_ppm (const uint8_t* framebuffer, const char* const path) {
+  static const uint8_t grays [4] = { 255, 170, 85, 0 };
+  FILE* const f = fopen(path, "wb");
+  if (!f) {
+    perror("unable to open framebuffer dump");
+    return -1;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", GB_SCREEN_WIDTH, GB_SCREEN_HEIGHT);
+  for (int y = 0; y < GB_SCREEN_HEIGHT; ++y) {
+    uint8_t row [GB_SCREEN_WIDTH * 3];
+    for (int x = 0; x < GB_SCREEN_WIDTH; ++x) {
+      const uint8_t gray = grays[*framebuffer++];
+      row[x * 3] = row[x * 3 + 1] = row[x * 3 + 2] = gray;
+    }
+    fwrite(row, sizeof(row), 1, f);
+  }
+  if (fclose(f)) {
+    perror("unable to write framebuffer dump");
+    return -1;
+  }
+  return 0;
+}
+
+int main (int argc, char** argv) {
+  unsigned long frames = 0;
+  unsigned long serial_bytes = 0;
+  bool until_verdict = false;
+  const char* ppm = NULL;
+  const char* load = NULL;
+  const char* save = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:vo:l:w:")) != -1) {
+    switch (opt) {
+      case 'n':
+        frames = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        serial_bytes = strtoul(optarg, NULL, 10);
+        break;
+      case 'v':
+        until_verdict = true;
+        break;
+      case 'o':
+        ppm = optarg;
+        break;
+      case 'l':
+        load = optarg;
+        break;
+      case 'w':
+        save = optarg;
+        break;
+      default:
+        usage();
+        return -1;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (argc < 1 || argc > 2 || (!frames && !serial_bytes && !until_verdict)) {
+    usage();
+    return -1;
+  }
+
+  struct gb_system* const gb = argc == 1 ? gb_create(NULL, argv[0], false) :
+    gb_create(argv[0], argv[1], false);
+  if (!gb) {
+    fprintf(stderr, "Failed to initialize system.\n");
+    return -1;
+  }
+  if (load && gb_load_state_file(gb, load)) {
+    gb_destroy(gb);
+    return -1;
+  }
+
+  size_t length = 0;
+  for (unsigned long frame = 0; !frames || frame < frames; ++frame) {
+    gb_serial_output(gb, &length);
+    if (serial_bytes && length >= serial_bytes) break;
+    if (until_verdict && gb_serial_verdict(gb) != kGbNoVerdict) break;
+    gb_run_frame(gb);
+  }
+  const char* const serial = gb_serial_output(gb, &length);
+  if (length) {
+    fwrite(serial, 1, length, stdout);
+  }
+  fflush(stdout);
+
+  int rc = ppm ? write_ppm(gb_framebuffer(gb), ppm) : 0;
+  if (!rc && save) {
+    rc = gb_save_state_file(gb, save);
+  }
+  if (!rc && until_verdict) {
+    const enum gb_verdict verdict = gb_serial_verdict(gb);
+    rc = verdict == kGbPassed ? 0 : verdict == kGbFailed ? 1 : 2;
+  }
+  gb_destroy(gb);
+  return rc;
+}
@@ -0,0 +1,774 @@
+#include "jit.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "block_cache.h"
+#include "logging.h"
+#include "scheduler.h"
+
+// Executions through the interpreter before a block gets translated.
+#define JIT_THRESHOLD 8
+#define JIT_CODE_SIZE (1 << 20)
+// The start of the code buffer maps the flags lahf leaves in ah to F.
+#define FLAGS_TABLE_SIZE 256
+// Generous upper bound on the native code for one block.
+#define JIT_MAX_BLOCK_SIZE (BLOCK_MAX_OPS * 160 + 64)
+// Keeps ebp, and so tick_cycles, well inside 16 bits however far off the
+// next event is.
+#define MAX_BUDGET 0x8000
+
+#define OFF(x) ((uint8_t)offsetof(struct cpu, x))
+#define BLOCK_OFF(x) ((uint8_t)offsetof(struct block, x))
+_Static_assert(sizeof(struct cpu) < 128,
+    "register file must be reachable with an 8 bit displacement");
+_Static_assert(offsetof(struct block, ops) < 128,
+    "block header must be reachable with an 8 bit displacement");
+
+// Translations keep the struct cpu in rbx, the T-cycles since the
+// scheduler's clock was last brought up to date in ebp, and how many of them
+// they may use before stopping in r12d.  See budget.  They're entered
+// through this, which jumps to code, and return through a shared exit.
+typedef void (*jit_entry) (struct cpu* const, const uint32_t budget,
+    const void* const code);
+
+struct jit {
+  uint8_t* code;
+  size_t used;
+  // Where the code shared by every translation ends.
+  size_t shared;
+  jit_entry enter;
+  const uint8_t* exit;
+  const uint8_t* dispatch;
+  struct cpu* cpu;
+  // Where the caller wants the CPU stopped, if no event comes first.
+  uint64_t end;
+  // Offsets into each cache slot's translation at which each op starts, for
+  // carrying on after a block stopped part way.
+  uint16_t entries [BLOCK_CACHE_SIZE][BLOCK_MAX_OPS];
+};
+
+// Where a block stops early, to let the interpreter carry on from op.
+struct exit_stub {
+  uint8_t* rel;
+  uint16_t pc;
+  uint8_t op;
+};
+
+// Emission state for a single block.
+struct emitter {
+  uint8_t* p;
+  // Where the block's code starts.
+  uint8_t* start;
+  const struct block* block;
+  const struct jit* jit;
+  struct cpu* cpu;
+  // Where the PC and cycle count stand as of the code emitted so far;
+  // pending_cycles have yet to be added to ebp.
+  uint16_t pc;
+  uint16_t pending_cycles;
+  // Whether the PC in the register file lags behind pc.
+  bool pc_dirty;
+  // Whether the f bitfield is known to be up to date under lazy flags, as
+  // after any op translated here that sets flags.
+  bool flags_synced;
+  // Checks before every op but the first, emitted after the block.
+  struct exit_stub exits [BLOCK_MAX_OPS];
+  int num_exits;
+};
+
+static void emit16 (struct emitter* const e, const uint16_t w) {
+  memcpy(e->p, &w, sizeof(w));
+  e->p += sizeof(w);
+}
+static void emit32 (struct emitter* const e, const uint32_t d) {
+  memcpy(e->p, &d, sizeof(d));
+  e->p += sizeof(d);
+}
+static void emit64 (struct emitter* const e, const uint64_t q) {
+  memcpy(e->p, &q, sizeof(q));
+  e->p += sizeof(q);
+}
+static void emit_bytes (struct emitter* const e, const uint8_t* const bytes,
+    const size_t n) {
+  memcpy(e->p, bytes, n);
+  e->p += n;
+}
+#define EMIT(e, ...) do { \
+  const uint8_t bytes [] = { __VA_ARGS__ }; \
+  emit_bytes(e, bytes, sizeof(bytes)); \
+} while (0)
+
+// Short forward branches: emit the opcode, then patch the rel8 when the
+// target is reached.
+static uint8_t* emit_jcc8 (struct emitter* const e, const uint8_t opcode) {
+  EMIT(e, opcode, 0x00);
+  return e->p - 1;
+}
+static void patch8 (struct emitter* const e, uint8_t* const rel) {
+  const ptrdiff_t d = e->p - (rel + 1);
+  assert(d >= 0 && d < 128);
+  *rel = (uint8_t)d;
+}
+
+// mov reg64, imm64; reg is the low 3 bits of the register number, rex adds
+// 0x01 for r8-r15.
+static void emit_mov_imm64 (struct emitter* const e, const uint8_t rex,
+    const uint8_t reg, const void* const ptr) {
+  EMIT(e, 0x48 | rex, 0xB8 | reg);
+  emit64(e, (uint64_t)(uintptr_t)ptr);
+}
+// mov rax, fn; call rax
+static void emit_call (struct emitter* const e, const void* const fn) {
+  emit_mov_imm64(e, 0, 0, fn);
+  EMIT(e, 0xFF, 0xD0);
+}
+// jmp / jcc rel32 to target; opcode is 0xE9 for jmp, or the second byte of a
+// 0x0F-prefixed jcc.
+static void emit_jump (struct emitter* const e, const uint8_t opcode,
+    const uint8_t* const target) {
+  if (opcode == 0xE9) {
+    EMIT(e, 0xE9);
+  } else {
+    EMIT(e, 0x0F, opcode);
+  }
+  emit32(e, (uint32_t)(target - (e->p + 4)));
+}
+
+static void flush_cycles (struct emitter* const e) {
+  if (e->pending_cycles) {
+    // add ebp, imm32
+    EMIT(e, 0x81, 0xC5);
+    emit32(e, e->pending_cycles);
+    e->pending_cycles = 0;
+  }
+}
+static void flush_pc (struct emitter* const e) {
+  // mov word [rbx+pc], imm16
+  EMIT(e, 0x66, 0xC7, 0x43, OFF(registers.pc));
+  emit16(e, e->pc);
+  e->pc_dirty = false;
+}
+
+// Leaves the block before op if it has used up its budget.
+static void emit_check (struct emitter* const e, const uint8_t op) {
+  flush_cycles(e);
+  // cmp ebp, r12d; jae stub
+  EMIT(e, 0x44, 0x39, 0xE5, 0x0F, 0x83);
+  assert(e->num_exits < (int)(sizeof(e->exits) / sizeof(e->exits[0])));
+  e->exits[e->num_exits++] = (struct exit_stub){ e->p, e->pc, op };
+  emit32(e, 0);
+}
+
+// Calls fn, which takes the cpu in rdi and returns a new budget, with the
+// cycle count in tick_cycles.
+static void emit_helper_call (struct emitter* const e, const void* const fn) {
+  // mov [rbx+tick_cycles], bp
+  EMIT(e, 0x66, 0x89, 0x6B, OFF(tick_cycles));
+  emit_call(e, fn);
+  // movzx ebp, word [rbx+tick_cycles]; mov r12d, eax
+  EMIT(e, 0x0F, 0xB7, 0x6B, OFF(tick_cycles), 0x41, 0x89, 0xC4);
+}
+
+// Cycles the block may still run for: until the next event or the caller's
+// end, measured from when the scheduler's clock was last brought up to date.
+// Helpers recompute it, since anything they do may post an event.
+static uint32_t budget (const struct cpu* const cpu) {
+  const struct scheduler* const s = cpu->mmu->scheduler;
+  uint64_t deadline = next_event_time(s);
+  if (cpu->jit->end < deadline) {
+    deadline = cpu->jit->end;
+  }
+  if (deadline <= s->now) return 0;
+  return deadline - s->now < MAX_BUDGET ? deadline - s->now : MAX_BUDGET;
+}
+
+// Whether get_block would still find the block at its start; a write to its
+// code or a bank switch under it mean it has to be looked up afresh.
+static bool still_current (const struct cpu* const cpu,
+    const struct block* const block) {
+  const uint8_t* const page = cpu->mmu->read_pages[block->start >> 8];
+  return block->valid && page && page + (block->start & 0xFF) == block->source;
+}
+
+// Brings the scheduler's clock up to the start of the current instruction,
+// where the interpreter would have it, before anything can look at it.
+static void sync_clock (struct cpu* const cpu) {
+  cpu->mmu->scheduler->now += cpu->tick_cycles;
+  cpu->tick_cycles = 0;
+}
+
+// Loads the byte at the address in eax into al.  Pages in the MMU's read
+// page table are read directly, anything else goes through rb.
+static void emit_load (struct emitter* const e) {
+  // mov ecx, eax; shr ecx, 8; mov rdx, read_pages; mov rdx, [rdx+rcx*8]
+  EMIT(e, 0x89, 0xC1, 0xC1, 0xE9, 0x08);
+  emit_mov_imm64(e, 0, 2, e->cpu->mmu->read_pages);
+  EMIT(e, 0x48, 0x8B, 0x14, 0xCA);
+  // test rdx, rdx; jz slow
+  EMIT(e, 0x48, 0x85, 0xD2);
+  uint8_t* const slow = emit_jcc8(e, 0x74);
+  // movzx ecx, al; mov al, [rdx+rcx]; jmp done
+  EMIT(e, 0x0F, 0xB6, 0xC8, 0x8A, 0x04, 0x0A);
+  uint8_t* const done = emit_jcc8(e, 0xEB);
+  patch8(e, slow);
+  // mov rdi, [rbx+mmu]; mov esi, eax
+  EMIT(e, 0x48, 0x8B, 0x7B, OFF(mmu), 0x89, 0xC6);
+  emit_call(e, (const void*)rb);
+  patch8(e, done);
+}
+
+// Returns no budget at all if the write invalidated the block or switched
+// its bank out.
+static uint32_t jit_store (struct cpu* const cpu, const uint16_t addr,
+    const uint8_t val, const struct block* const block) {
+  sync_clock(cpu);
+  wb(cpu->mmu, addr, val);
+  return still_current(cpu, block) ? budget(cpu) : 0;
+}
+
+// Stores dl to the address in eax.  Pages in the MMU's write page table
+// that hold no cached code are written directly, anything else goes through
+// wb, after which the block stops if the write invalidated it or posted an
+// event.  Cycles up to the start of the instruction must already be flushed.
+static void emit_store (struct emitter* const e) {
+  assert(e->pending_cycles == 0);
+  // mov ecx, eax; shr ecx, 8; mov r8, write_pages; mov r8, [r8+rcx*8]
+  EMIT(e, 0x89, 0xC1, 0xC1, 0xE9, 0x08);
+  emit_mov_imm64(e, 1, 0, e->cpu->mmu->write_pages);
+  EMIT(e, 0x4D, 0x8B, 0x04, 0xC8);
+  // test r8, r8; jz slow
+  EMIT(e, 0x4D, 0x85, 0xC0);
+  uint8_t* const slow = emit_jcc8(e, 0x74);
+  // mov esi, eax; shr esi, CODE_CHUNK_SHIFT; mov rcx, chunks
+  EMIT(e, 0x89, 0xC6, 0xC1, 0xEE, CODE_CHUNK_SHIFT);
+  emit_mov_imm64(e, 0, 1, e->cpu->blocks->code_chunks);
+  EMIT(e, 0x80, 0x3C, 0x31, 0x00); // cmp byte [rcx+rsi], 0
+  uint8_t* const code = emit_jcc8(e, 0x75); // jne
+  // movzx ecx, al; mov [r8+rcx], dl; jmp done
+  EMIT(e, 0x0F, 0xB6, 0xC8, 0x41, 0x88, 0x14, 0x08);
+  uint8_t* const done = emit_jcc8(e, 0xEB);
+  patch8(e, slow);
+  patch8(e, code);
+  // mov rdi, rbx; mov esi, eax; mov rcx, block
+  EMIT(e, 0x48, 0x89, 0xDF, 0x89, 0xC6);
+  emit_mov_imm64(e, 0, 1, e->block);
+  emit_helper_call(e, (const void*)jit_store);
+  patch8(e, done);
+}
+
+// movzx eax, word [rbx+off]
+static void emit_address_from (struct emitter* const e, const uint8_t off) {
+  EMIT(e, 0x0F, 0xB7, 0x43, off);
+}
+// movzx edx, byte [rbx+off]
+static void emit_value_from (struct emitter* const e, const uint8_t off) {
+  EMIT(e, 0x0F, 0xB6, 0x53, off);
+}
+// mov [rbx+off], al
+static void emit_result_to (struct emitter* const e, const uint8_t off) {
+  EMIT(e, 0x88, 0x43, off);
+}
+
+// Goes straight back round a loop to the start of the block while the budget
+// lasts, without the dispatcher's lookup; helpers leave no budget if the
+// block may have gone stale.  Cycles must already be flushed.
+static void emit_loop (struct emitter* const e) {
+  assert(e->pending_cycles == 0);
+  // cmp ebp, r12d; jb start
+  EMIT(e, 0x44, 0x39, 0xE5);
+  emit_jump(e, 0x82, e->start);
+}
+
+// Under lazy flags, brings the f bitfield up to date for an op that reads it.
+static void emit_need_flags (struct emitter* const e) {
+#ifdef USE_LAZY_FLAGS
+  if (!e->flags_synced) {
+    // cmp byte [rbx+lazy.kind], kFlagsSynced; je synced; mov rdi, rbx
+    EMIT(e, 0x80, 0x7B, OFF(lazy.kind), kFlagsSynced);
+    uint8_t* const synced = emit_jcc8(e, 0x74);
+    EMIT(e, 0x48, 0x89, 0xDF);
+    emit_call(e, (const void*)sync_flags);
+    patch8(e, synced);
+    e->flags_synced = true;
+  }
+#else
+  (void)e;
+#endif
+}
+
+// Converts the host flags that lahf left in ah to Z, H and C as F holds them,
+// in cl, keeping only the bits in mask.
+static void emit_flags_from_ah (struct emitter* const e, const uint8_t mask) {
+  // movzx ecx, ah; lea rdx, [rip+flags_table]; movzx ecx, byte [rdx+rcx]
+  EMIT(e, 0x0F, 0xB6, 0xCC, 0x48, 0x8D, 0x15);
+  emit32(e, (uint32_t)(e->jit->code - (e->p + 4)));
+  EMIT(e, 0x0F, 0xB6, 0x0C, 0x0A);
+  if (mask != 0xB0) {
+    EMIT(e, 0x80, 0xE1, mask); // and cl, mask
+  }
+}
+
+// Stores cl and set into F, which keeps only the bits in keep, and leaves
+// the flags synced.
+static void emit_set_flags (struct emitter* const e, const uint8_t set,
+    const uint8_t keep) {
+  if (set) {
+    EMIT(e, 0x80, 0xC9, set); // or cl, set
+  }
+  // and byte [rbx+f], keep; or [rbx+f], cl
+  EMIT(e, 0x80, 0x63, OFF(registers.af), keep,
+      0x08, 0x4B, OFF(registers.af));
+#ifdef USE_LAZY_FLAGS
+  if (!e->flags_synced) {
+    EMIT(e, 0xC6, 0x43, OFF(lazy.kind), kFlagsSynced);
+    e->flags_synced = true;
+  }
+#endif
+}
+
+// A = A op dl, or just the flags for CP, where op is numbered as in opcodes
+// 0x80-0xBF: ADD, ADC, SUB, SBC, AND, XOR, OR, CP.  The host computes Z, H
+// and C exactly as the SM83 does; ADC and SBC take C in through CF.
+static void emit_alu (struct emitter* const e, const uint8_t op) {
+  static const uint8_t opcodes [8] = {
+    0x00, 0x10, 0x28, 0x18, 0x20, 0x30, 0x08, 0x38,
+  };
+  // mov al, [rbx+a]
+  EMIT(e, 0x8A, 0x43, OFF(registers.a));
+  if (op == 1 || op == 3) {
+    // bt dword [rbx+af], 4
+    EMIT(e, 0x0F, 0xBA, 0x63, OFF(registers.af), 4);
+  }
+  // op al, dl
+  EMIT(e, opcodes[op], 0xD0);
+  if (op != 7) {
+    emit_result_to(e, OFF(registers.a));
+  }
+  if (op >= 4 && op <= 6) {
+    // AND, XOR and OR leave H and C to be set by hand: setz cl; shl cl, 7
+    EMIT(e, 0x0F, 0x94, 0xC1, 0xC0, 0xE1, 0x07);
+    emit_set_flags(e, op == 4 ? 0x20 : 0, 0x0F);
+  } else {
+    EMIT(e, 0x9F); // lahf
+    emit_flags_from_ah(e, 0xB0);
+    emit_set_flags(e, op >= 2 ? 0x40 : 0, 0x0F);
+  }
+}
+
+static uint32_t jit_step (struct cpu* const cpu,
+    const struct decoded_op* const op, const struct block* const block) {
+  sync_clock(cpu);
+  execute_op(cpu, op);
+  return still_current(cpu, block) ? budget(cpu) : 0;
+}
+
+// Hands one instruction to the interpreter.
+static void emit_step (struct emitter* const e,
+    const struct decoded_op* const op) {
+  flush_cycles(e);
+  flush_pc(e);
+  // mov rdi, rbx
+  EMIT(e, 0x48, 0x89, 0xDF);
+  emit_mov_imm64(e, 0, 6, op); // mov rsi, op
+  emit_mov_imm64(e, 0, 2, e->block); // mov rdx, block
+  emit_helper_call(e, (const void*)jit_step);
+  e->flags_synced = false;
+}
+
+// Offsets of B, C, D, E, H, L, (HL), A in opcode operand order.
+static int reg8_offset (const uint8_t index) {
+  switch (index) {
+    case 0: return OFF(registers.b);
+    case 1: return OFF(registers.c);
+    case 2: return OFF(registers.d);
+    case 3: return OFF(registers.e);
+    case 4: return OFF(registers.h);
+    case 5: return OFF(registers.l);
+    case 7: return OFF(registers.a);
+    default: return -1;
+  }
+}
+// BC, DE, HL, SP
+static uint8_t reg16_offset (const uint8_t index) {
+  switch (index) {
+    case 0: return OFF(registers.bc);
+    case 1: return OFF(registers.de);
+    case 2: return OFF(registers.hl);
+    default: return OFF(registers.sp);
+  }
+}
+
+// Returns false if op has no native translation.  Jumps to themselves are left
+// to the interpreter, which lets the CPU spin until the next event.
+static bool emit_native (struct emitter* const e,
+    const struct decoded_op* const op) {
+  const uint16_t next_pc = op->pc + op->length;
+  const uint16_t imm16 = op->imm[0] | (op->imm[1] << 8);
+  const uint8_t o = op->op;
+
+  if (o == 0x00) { // NOP
+  } else if (o >= 0x40 && o < 0x80 && o != 0x76) {
+    const int dst = reg8_offset((o >> 3) & 7);
+    const int src = reg8_offset(o & 7);
+    if (dst >= 0 && src >= 0) { // LD r,r
+      EMIT(e, 0x8A, 0x43, (uint8_t)src, 0x88, 0x43, (uint8_t)dst);
+    } else if (dst >= 0) { // LD r,(HL)
+      emit_address_from(e, OFF(registers.hl));
+      emit_load(e);
+      emit_result_to(e, (uint8_t)dst);
+      e->pending_cycles += 4;
+    } else { // LD (HL),r
+      flush_cycles(e);
+      emit_value_from(e, (uint8_t)src);
+      emit_address_from(e, OFF(registers.hl));
+      emit_store(e);
+      e->pending_cycles += 4;
+    }
+  } else if ((o & 0xC7) == 0x06 && o != 0x36) { // LD r,d8
+    EMIT(e, 0xC6, 0x43, (uint8_t)reg8_offset(o >> 3), op->imm[0]);
+  } else if ((o & 0xCF) == 0x01) { // LD rr,d16
+    EMIT(e, 0x66, 0xC7, 0x43, reg16_offset(o >> 4));
+    emit16(e, imm16);
+  } else if ((o & 0xC7) == 0x03) { // INC rr / DEC rr
+    EMIT(e, 0x66, 0xFF, (o & 0x08) ? 0x4B : 0x43, reg16_offset(o >> 4));
+    e->pending_cycles += 4;
+  } else if (o == 0x0A || o == 0x1A || o == 0x2A || o == 0x3A ||
+      o == 0xFA) { // LD A,(BC) / (DE) / (HL+) / (HL-) / (a16)
+    if (o == 0xFA) {
+      EMIT(e, 0xB8); // mov eax, imm32
+      emit32(e, imm16);
+    } else {
+      emit_address_from(e, o < 0x20 ? reg16_offset(o >> 4) : OFF(registers.hl));
+    }
+    if (o == 0x2A || o == 0x3A) {
+      EMIT(e, 0x66, 0xFF, o == 0x2A ? 0x43 : 0x4B, OFF(registers.hl));
+    }
+    emit_load(e);
+    emit_result_to(e, OFF(registers.a));
+    e->pending_cycles += 4;
+  } else if (o == 0x02 || o == 0x12 || o == 0x22 || o == 0x32 ||
+      o == 0x36 || o == 0xEA) { // LD (BC) / (DE) / (HL+) / (HL-) / (a16),A
+    flush_cycles(e);
+    if (o == 0xEA) {
+      EMIT(e, 0xB8);
+      emit32(e, imm16);
+    } else {
+      emit_address_from(e, o < 0x20 ? reg16_offset(o >> 4) : OFF(registers.hl));
+    }
+    if (o == 0x22 || o == 0x32) {
+      EMIT(e, 0x66, 0xFF, o == 0x22 ? 0x43 : 0x4B, OFF(registers.hl));
+    }
+    if (o == 0x36) { // LD (HL),d8
+      EMIT(e, 0xBA); // mov edx, imm32
+      emit32(e, op->imm[0]);
+    } else {
+      emit_value_from(e, OFF(registers.a));
+    }
+    emit_store(e);
+    e->pending_cycles += 4;
+  } else if (o == 0xF9) { // LD SP,HL
+    // mov ax, [rbx+hl]; mov [rbx+sp], ax
+    EMIT(e, 0x66, 0x8B, 0x43, OFF(registers.hl),
+        0x66, 0x89, 0x43, OFF(registers.sp));
+    e->pending_cycles += 4;
+  } else if (o >= 0x80 && o < 0xC0) { // ADD, ADC, SUB, SBC, AND, XOR, OR, CP
+    const uint8_t alu = (o >> 3) & 7;
+    const int src = reg8_offset(o & 7);
+    if (alu == 1 || alu == 3) {
+      emit_need_flags(e);
+    }
+    if (src >= 0) {
+      emit_value_from(e, (uint8_t)src);
+    } else { // (HL)
+      emit_address_from(e, OFF(registers.hl));
+      emit_load(e);
+      EMIT(e, 0x89, 0xC2); // mov edx, eax
+      e->pending_cycles += 4;
+    }
+    emit_alu(e, alu);
+  } else if ((o & 0xC7) == 0xC6) { // ADD, ADC, ... CP d8
+    const uint8_t alu = (o >> 3) & 7;
+    if (alu == 1 || alu == 3) {
+      emit_need_flags(e);
+    }
+    EMIT(e, 0xBA); // mov edx, imm32
+    emit32(e, op->imm[0]);
+    emit_alu(e, alu);
+  } else if ((o & 0xC6) == 0x04 && o != 0x34 && o != 0x35) { // INC r / DEC r
+    const bool dec = o & 1;
+    // C is left alone.
+    emit_need_flags(e);
+    // inc / dec byte [rbx+r]; lahf
+    EMIT(e, 0xFE, dec ? 0x4B : 0x43, (uint8_t)reg8_offset(o >> 3), 0x9F);
+    emit_flags_from_ah(e, 0xA0);
+    emit_set_flags(e, dec ? 0x40 : 0, 0x1F);
+  } else if (o == 0xCB && (op->imm[0] & 0xC0) == 0x40 &&
+      (op->imm[0] & 7) != 6) { // BIT n,r
+    emit_need_flags(e);
+    // test byte [rbx+r], 1 << n; setz cl; shl cl, 7
+    EMIT(e, 0xF6, 0x43, (uint8_t)reg8_offset(op->imm[0] & 7),
+        1 << ((op->imm[0] >> 3) & 7), 0x0F, 0x94, 0xC1, 0xC0, 0xE1, 0x07);
+    emit_set_flags(e, 0x20, 0x1F);
+    // The interpreter's 0xCB prefix costs another 4.
+    e->pending_cycles += 4;
+  } else if (((o & 0xE7) == 0x20 && op->imm[0] != 0xFE) ||
+      ((o & 0xE7) == 0xC2 && imm16 != op->pc)) { // JR cc,r8 / JP cc,a16
+    const uint16_t target =
+      (o & 0xE7) == 0x20 ? next_pc + (int8_t)op->imm[0] : imm16;
+    emit_need_flags(e);
+    flush_cycles(e);
+    // test byte [rbx+f], Z or C; then skip the jump on NZ / NC if it's set,
+    // on Z / C if it's clear.
+    EMIT(e, 0xF6, 0x43, OFF(registers.af), (o & 0x10) ? 0x10 : 0x80);
+    uint8_t* const not_taken = emit_jcc8(e, (o & 0x08) ? 0x74 : 0x75);
+    // Taken, the block ends here: mov word [rbx+pc], target
+    EMIT(e, 0x66, 0xC7, 0x43, OFF(registers.pc));
+    emit16(e, target);
+    e->pending_cycles = op->cycles + 4;
+    flush_cycles(e);
+    if (target == e->block->start) {
+      if (e->block->polls) {
+        // Going round a polling loop again; see is_polling_loop.
+        EMIT(e, 0xC6, 0x43, OFF(state), kPolling);
+      } else {
+        emit_loop(e);
+      }
+    }
+    emit_jump(e, 0xE9, e->jit->dispatch);
+    patch8(e, not_taken);
+  } else if (o == 0xC3 && imm16 != op->pc) { // JP a16
+    e->pending_cycles += op->cycles;
+    e->pc = imm16;
+    e->pc_dirty = true;
+    return true;
+  } else if (o == 0x18 && op->imm[0] != 0xFE) { // JR r8
+    e->pending_cycles += op->cycles + 4;
+    e->pc = next_pc + (int8_t)op->imm[0];
+    e->pc_dirty = true;
+    return true;
+  } else {
+    return false;
+  }
+  e->pending_cycles += op->cycles;
+  e->pc = next_pc;
+  e->pc_dirty = true;
+  return true;
+}
+
+static void flush_translations (struct jit* const jit) {
+  struct block_cache* const cache = jit->cpu->blocks;
+  for (size_t i = 0; i < BLOCK_CACHE_SIZE; ++i) {
+    cache->blocks[i].native = NULL;
+  }
+  jit->used = jit->shared;
+}
+
+// The code buffer is never writable and executable at once: it is only made
+// writable while something is emitted into it.  Returns 0 on success.
+static int protect_code (struct jit* const jit, const int prot) {
+  if (mprotect(jit->code, JIT_CODE_SIZE, prot)) {
+    perror("JIT disabled, unable to change code buffer protection");
+    return -1;
+  }
+  return 0;
+}
+
+// Returns 0 on success
+static int translate (struct jit* const jit, struct block* const block) {
+  if (protect_code(jit, PROT_READ | PROT_WRITE)) return -1;
+  if (JIT_CODE_SIZE - jit->used < JIT_MAX_BLOCK_SIZE) {
+    LOG(5, "JIT: code buffer full, flushing\n");
+    flush_translations(jit);
+  }
+  struct emitter e = {
+    .p = jit->code + jit->used,
+    .start = jit->code + jit->used,
+    .block = block,
+    .jit = jit,
+    .cpu = jit->cpu,
+    .pc = block->start,
+  };
+  uint8_t* const start = e.p;
+  uint16_t* const entries = jit->entries[block - jit->cpu->blocks->blocks];
+  for (int i = 0; i < block->count; ++i) {
+    const struct decoded_op* const op = &block->ops[i];
+    // Whoever jumps in checks there's time for the first.
+    if (i > 0) {
+      flush_cycles(&e);
+      entries[i] = (uint16_t)(e.p - start);
+      emit_check(&e, i);
+    } else {
+      entries[i] = 0;
+    }
+    if (!emit_native(&e, op)) {
+      // Steps through the interpreter leave the PC where they want it.
+      emit_step(&e, op);
+      e.pc = op->pc + op->length;
+    }
+  }
+  flush_cycles(&e);
+  if (e.pc_dirty) {
+    flush_pc(&e);
+  }
+  if (e.pc == block->start) {
+    emit_loop(&e);
+  }
+  emit_jump(&e, 0xE9, jit->dispatch);
+  // Out of line, so the common path falls straight through each check.
+  for (int i = 0; i < e.num_exits; ++i) {
+    const struct exit_stub* const stub = &e.exits[i];
+    const int32_t rel = (int32_t)(e.p - (stub->rel + 4));
+    memcpy(stub->rel, &rel, sizeof(rel));
+    // mov word [rbx+pc], imm16; mov byte [rbx+block_pos], imm8; jmp exit
+    EMIT(&e, 0x66, 0xC7, 0x43, OFF(registers.pc));
+    emit16(&e, stub->pc);
+    EMIT(&e, 0xC6, 0x43, OFF(block_pos), stub->op);
+    emit_jump(&e, 0xE9, jit->exit);
+  }
+  assert((size_t)(e.p - start) <= JIT_MAX_BLOCK_SIZE);
+  jit->used += e.p - start;
+  block->native = start;
+  LOG(5, "JIT: translated " PRIshort " (%d ops, %zu bytes)\n", block->start,
+      block->count, (size_t)(e.p - start));
+  return protect_code(jit, PROT_READ | PROT_EXEC);
+}
+
+// Emits the code every translation shares after the flags table: the way in,
+// the way out, and the dispatcher that chains from the end of one block
+// straight into the translation of the next while the budget lasts.
+static void emit_shared (struct jit* const jit) {
+  struct emitter e = {
+    .p = jit->code + FLAGS_TABLE_SIZE,
+    .jit = jit,
+    .cpu = jit->cpu,
+  };
+  const struct cpu* const cpu = jit->cpu;
+  jit->enter = (jit_entry)(void*)e.p;
+  // push rbx; push rbp; push r12; mov rbx, rdi; xor ebp, ebp; mov r12d, esi;
+  // jmp rdx
+  EMIT(&e, 0x53, 0x55, 0x41, 0x54, 0x48, 0x89, 0xFB, 0x31, 0xED,
+      0x41, 0x89, 0xF4, 0xFF, 0xE2);
+  jit->exit = e.p;
+  // mov [rbx+tick_cycles], bp; pop r12; pop rbp; pop rbx; ret
+  EMIT(&e, 0x66, 0x89, 0x6B, OFF(tick_cycles), 0x41, 0x5C, 0x5D, 0x5B, 0xC3);
+  jit->dispatch = e.p;
+  // cmp ebp, r12d; jae exit; cmp byte [rbx+state], kRunning; jne exit
+  EMIT(&e, 0x44, 0x39, 0xE5);
+  emit_jump(&e, 0x83, jit->exit);
+  EMIT(&e, 0x80, 0x7B, OFF(state), kRunning);
+  emit_jump(&e, 0x85, jit->exit);
+  // movzx eax, word [rbx+pc]; mov ecx, eax; and ecx, BLOCK_CACHE_SIZE - 1;
+  // imul ecx, ecx, sizeof(struct block); mov rdx, blocks; add rcx, rdx
+  EMIT(&e, 0x0F, 0xB7, 0x43, OFF(registers.pc), 0x89, 0xC1, 0x81, 0xE1);
+  emit32(&e, BLOCK_CACHE_SIZE - 1);
+  EMIT(&e, 0x69, 0xC9);
+  emit32(&e, sizeof(struct block));
+  emit_mov_imm64(&e, 0, 2, cpu->blocks->blocks);
+  EMIT(&e, 0x48, 0x01, 0xD1);
+  // The same tests as get_block, short of decoding anything: cmp [rcx+start],
+  // ax; jne exit; cmp byte [rcx+valid], 0; je exit
+  EMIT(&e, 0x66, 0x39, 0x41, BLOCK_OFF(start));
+  emit_jump(&e, 0x85, jit->exit);
+  EMIT(&e, 0x80, 0x79, BLOCK_OFF(valid), 0x00);
+  emit_jump(&e, 0x84, jit->exit);
+  // mov rdx, [rcx+native]; test rdx, rdx; jz exit
+  EMIT(&e, 0x48, 0x8B, 0x51, BLOCK_OFF(native), 0x48, 0x85, 0xD2);
+  emit_jump(&e, 0x84, jit->exit);
+  // mov esi, eax; shr esi, 8; mov r8, read_pages; mov rsi, [r8+rsi*8];
+  // test rsi, rsi; jz exit
+  EMIT(&e, 0x89, 0xC6, 0xC1, 0xEE, 0x08);
+  emit_mov_imm64(&e, 1, 0, cpu->mmu->read_pages);
+  EMIT(&e, 0x49, 0x8B, 0x34, 0xF0, 0x48, 0x85, 0xF6);
+  emit_jump(&e, 0x84, jit->exit);
+  // movzx eax, al; add rsi, rax; cmp rsi, [rcx+source]; jne exit
+  EMIT(&e, 0x0F, 0xB6, 0xC0, 0x48, 0x01, 0xC6,
+      0x48, 0x3B, 0x71, BLOCK_OFF(source));
+  emit_jump(&e, 0x85, jit->exit);
+  // mov [rbx+block], rcx; movzx eax, byte [rcx+count];
+  // mov [rbx+block_pos], al; jmp rdx
+  EMIT(&e, 0x48, 0x89, 0x4B, OFF(block), 0x0F, 0xB6, 0x41, BLOCK_OFF(count),
+      0x88, 0x43, OFF(block_pos), 0xFF, 0xE2);
+  jit->shared = e.p - jit->code;
+}
+
+struct jit* create_jit (struct cpu* const cpu) {
+  struct jit* const jit = malloc(sizeof(struct jit));
+  if (!jit) return NULL;
+  jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED) {
+    perror("JIT disabled, unable to map code buffer");
+    free(jit);
+    return NULL;
+  }
+  // lahf leaves SF ZF 0 AF 0 PF 1 CF in ah; F holds Z N H C in its high
+  // nibble.
+  for (int ah = 0; ah < FLAGS_TABLE_SIZE; ++ah) {
+    jit->code[ah] =
+      ((ah & 0x40) << 1) | ((ah & 0x10) << 1) | ((ah & 0x01) << 4);
+  }
+  jit->cpu = cpu;
+  emit_shared(jit);
+  jit->used = jit->shared;
+  if (protect_code(jit, PROT_READ | PROT_EXEC)) {
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+    return NULL;
+  }
+  return jit;
+}
+
+void destroy_jit (struct jit* const jit) {
+  if (jit) {
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+  }
+}
+
+bool jit_tick (struct cpu* const cpu, const uint64_t end) {
+  struct jit* const jit = cpu->jit;
+  const struct block* block = cpu->block;
+  const uint8_t* code;
+  if (block && block->valid && cpu->block_pos < block->count &&
+      block->ops[cpu->block_pos].pc == cpu->registers.pc) {
+    // Carry on part way through, where the translation left off.
+    if (!block->native) return false;
+    code = (const uint8_t*)block->native +
+      jit->entries[block - cpu->blocks->blocks][cpu->block_pos];
+#ifdef USE_LAZY_FLAGS
+    // The translation may have assumed flags it set itself were synced.
+    sync_flags(cpu);
+#endif
+  } else {
+    struct block* const next =
+      get_block(cpu->blocks, cpu->mmu, cpu->registers.pc);
+    cpu->block = next;
+    cpu->block_pos = 0;
+    if (!next->native) {
+      if (++next->hits < JIT_THRESHOLD) return false;
+      if (translate(jit, next)) {
+        // Nothing in the buffer can be trusted to run any more, so leave
+        // everything to the interpreter from now on.
+        flush_translations(jit);
+        destroy_jit(jit);
+        cpu->jit = NULL;
+        return false;
+      }
+    }
+    block = next;
+    code = next->native;
+  }
+  // Make the next tick look up a block afresh, unless the translation stops
+  // part way and leaves the rest to the interpreter.
+  cpu->block_pos = block->count;
+  jit->end = end;
+  cpu->tick_cycles = 0;
+  jit->enter(cpu, budget(cpu), code);
+  return true;
+}
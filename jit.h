@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "cpu.h"
+
+// Translates hot blocks from the block cache into x86-64.  Loads, stores,
+// moves, 8 bit arithmetic and logic, BIT and jumps are emitted natively
+// against the struct cpu register file, everything else calls straight into
+// the interpreter's handler for that op.  Translations run on into one
+// another until the next event is due.
+
+struct jit;
+
+struct jit* create_jit (struct cpu* const cpu);
+void destroy_jit (struct jit* const jit);
+// Runs a translated block if the CPU is at the start of a hot one, stopping
+// early at the next event or end so that everything happens on the same cycle
+// it would under the interpreter.  Returns false if the interpreter should
+// execute the next instruction.
+bool jit_tick (struct cpu* const cpu, const uint64_t end);
@@ -2,15 +2,16 @@
 
 #include <assert.h>
 #include <stdio.h>
-
-#include "SDL_render.h"
+#include <stdlib.h>
+#include <string.h>
 
 #include "logging.h"
 
 static void transition (struct lcd* const lcd, const uint8_t mode) {
   LOG(5, "LCD: transition from %d to %d\n", lcd->mode, mode);
   lcd->mode = mode;
-  lcd->cycles_in_current_mode = 0;
+  // STAT reports the mode in its low two bits.
+  wb(lcd->mmu, 0xFF41, (rb(lcd->mmu, 0xFF41) & ~0x03) | mode);
 }
 
 static int is_lcd_on (const struct lcd* const lcd) {
@@ -18,253 +19,192 @@ static int is_lcd_on (const struct lcd* const lcd) {
   return !!(lcdc & (1 << 7));
 }
 
-static void update_line (struct lcd* const lcd, const uint8_t cycles) {
-  lcd->cycles_in_current_line += cycles;
-
-  if (lcd->cycles_in_current_line >= 456) {
-    lcd->cycles_in_current_line = 0;
-    // TODO: modulo?
-    ++lcd->line;
-    if (lcd->line == 154) {
-      lcd->line = 0;
-    }
-    LOG(5, "LCD: advancing to line %d\n", lcd->line);
-    wb(lcd->mmu, 0xFF44, lcd->line);
-    // vblank interrupt
-    if (lcd->line == 144) {
-      wb(lcd->mmu, 0xFF0F, rb(lcd->mmu, 0xFF0F) | 0x01);
+static void next_line (struct lcd* const lcd) {
+  ++lcd->line;
+  if (lcd->line == 154) {
+    lcd->line = 0;
+  }
+  LOG(5, "LCD: advancing to line %d\n", lcd->line);
+  wb(lcd->mmu, 0xFF44, lcd->line);
+}
+
+// The tile cache slot for tile number n under the LCDC tile data select;
+// 0x8800 addressing uses signed tile numbers around 0x9000.
+static uint16_t tile_slot (const uint8_t lcdc, const uint8_t n) {
+  return (lcdc & (1 << 4)) ? n : (uint16_t)(256 + (int8_t)n);
+}
+
+// Copies palette numbers for pixels [x, SCREEN_WIDTH) from the tilemap row at
+// map, starting at map pixel px.
+static void draw_tiles (const struct lcd* const lcd, const uint8_t lcdc,
+    const uint8_t* const map, const uint8_t y, uint8_t px, int x,
+    uint8_t* const line) {
+  while (x < SCREEN_WIDTH) {
+    const uint8_t* const row =
+      lcd->tiles->pixels[tile_slot(lcdc, map[px >> 3])][y & 7];
+    for (int i = px & 7; i < 8 && x < SCREEN_WIDTH; ++i, ++x, ++px) {
+      line[x] = row[i];
     }
   }
 }
 
-// http://gameboy.mongenel.com/dmg/gbc_lcdc_timing.txt`
-void update_lcd (struct lcd* const lcd, const uint8_t cycles) {
-  if (!is_lcd_on(lcd)) {
-    return;
-  }
-
-  lcd->total_cycles += cycles;
-  lcd->cycles_in_current_mode += cycles;
-  update_line(lcd, cycles);
-
-  switch (lcd->mode) {
-    // HBlank
-    case 0:
-      if (lcd->cycles_in_current_mode >= 204) {
-
-        if (lcd->line == 144) {
-          transition(lcd, 1);
-        } else {
-          transition(lcd, 2);
-        }
-      }
-      break;
-    // VBlank
-    case 1:
-      if (lcd->cycles_in_current_mode >= 4560) {
-        transition(lcd, 2);
-      }
-      break;
-    case 2:
-      if (lcd->cycles_in_current_mode >= 80) {
-        transition(lcd, 3);
-      }
-      break;
-    case 3:
-      if (lcd->cycles_in_current_mode >= 172) {
-        transition(lcd, 0);
-      }
-      // draw scanline?
-      break;
-    default:
-      // Not a valid mode
-      assert(false);
+struct sprite {
+  uint8_t y;
+  uint8_t x;
+  uint8_t tile;
+  uint8_t flags;
+};
+
+// Up to 10 sprites on this line, in OAM order.  Returns how many.
+static int find_sprites (const struct lcd* const lcd, const uint8_t height,
+    struct sprite* const found) {
+  const struct sprite* const oam =
+    (const struct sprite*)lcd->mmu->oam;
+  int count = 0;
+  for (int i = 0; i < 40 && count < 10; ++i) {
+    const int top = oam[i].y - 16;
+    if (lcd->line >= top && lcd->line < top + height) {
+      found[count++] = oam[i];
+    }
   }
-}
-
-// AKA BG & Window Tile Data Select
-static int bg_active_tileset (const struct lcd* const lcd) {
-  const uint8_t lcdc = rb(lcd->mmu, 0xFF00);
-  LOG(4, "active tileset: %d\n", !!(lcdc & (1 << 4)));
-  return !!(lcdc & (1 << 4));
-}
-
-static int bg_active_tilemap (const struct lcd* const lcd) {
-  const uint8_t lcdc = rb(lcd->mmu, 0xFF00);
-  LOG(4, "active tilemap: %d\n", !!(lcdc & (1 << 3)));
-  return !!(lcdc & (1 << 3));
-}
-
-static void paint_bg_tilemap (uint8_t* map_data,
-    const struct lcd* const lcd) {
-
-  const int active_tilemap = bg_active_tilemap(lcd);
-  const uint16_t base = active_tilemap ? 0x9C00 : 0x9800;
-  const uint16_t top = active_tilemap ? 0x9FFF : 0x9BFF;
-  for (uint16_t addr = base; addr < top; addr += 32) {
-    for (int x = 0; x < 32; ++x) {
-      *map_data = rb(lcd->mmu, addr + x);
-      /*printf("%d |", *map_data);*/
-      ++map_data;
+  return count;
+}
+
+// Sprites with lower X win, then earlier in OAM, so paint the others first.
+static void draw_sprites (const struct lcd* const lcd, const uint8_t lcdc,
+    const uint8_t* const bg, uint8_t* const out) {
+  const uint8_t* const io = lcd->mmu->io;
+  const uint8_t height = (lcdc & (1 << 2)) ? 16 : 8;
+  struct sprite sprites [10];
+  const int count = find_sprites(lcd, height, sprites);
+  // Stable insertion sort by X.
+  for (int i = 1; i < count; ++i) {
+    const struct sprite s = sprites[i];
+    int j = i;
+    for (; j > 0 && sprites[j - 1].x > s.x; --j) {
+      sprites[j] = sprites[j - 1];
     }
-    /*puts("");*/
+    sprites[j] = s;
   }
-}
-
-static uint8_t get_palette_number (const int bit_pos, const uint8_t low,
-    const uint8_t high) {
-  // Wont work for bit_pos 0, since we'd be right shifting by a negative number
-  assert(0 < bit_pos && bit_pos < 8);
-  /*return ((high & (1 << 7)) >> 6) | ((low & (1 << 7)) >> 7);*/
-  return ((high & (1 << bit_pos)) >> (bit_pos - 1)) |
-    ((low & (1 << bit_pos)) >> bit_pos);
-}
-
-static void shade_tiles (uint8_t* tile_data, const struct lcd* const lcd) {
-  const int active_tileset = bg_active_tileset(lcd);
-  const uint16_t base = active_tileset ? 0x8000 : 0x8800;
-  const uint16_t top = active_tileset ? 0x8FFF : 0x97FF;
-
-  for (uint16_t addr = base; addr < top; addr += 16) {
-    const uint16_t ttop = addr + 16;
-    // one tile
-    for (uint16_t taddr = addr; taddr < ttop; taddr += 2) {
-      // one row
-      const uint8_t low = rb(lcd->mmu, taddr);
-      const uint8_t high = rb(lcd->mmu, taddr + 1);
-      for (int i = 0; i < 7; ++i) {
-        *tile_data = get_palette_number(7 - i, low, high);
-        /*printf("%d", *tile_data);*/
-        ++tile_data;
-      }
-      *tile_data = ((high & (1 << 0)) << 1) | ((low & (1 << 0)) >> 0);
-      /*printf("%d\n", *tile_data);*/
-      ++tile_data;
+  for (int i = count - 1; i >= 0; --i) {
+    const struct sprite* const s = &sprites[i];
+    int row = lcd->line - (s->y - 16);
+    if (s->flags & (1 << 6)) {
+      row = height - 1 - row;
+    }
+    const uint8_t tile = height == 16 ? (s->tile & 0xFE) + (row >> 3) : s->tile;
+    const uint8_t* const pixels = lcd->tiles->pixels[tile][row & 7];
+    const uint8_t palette = io[(s->flags & (1 << 4)) ? 0x49 : 0x48];
+    const bool behind_bg = s->flags & (1 << 7);
+    for (int col = 0; col < 8; ++col) {
+      const int x = s->x - 8 + col;
+      if (x < 0 || x >= SCREEN_WIDTH) continue;
+      const uint8_t color = pixels[(s->flags & (1 << 5)) ? 7 - col : col];
+      if (!color || (behind_bg && bg[x])) continue;
+      out[x] = (palette >> (color * 2)) & 3;
     }
-    /*puts("");*/
   }
 }
 
-// renderer agnostic
-static void paint_tile (const uint8_t* tile_data, SDL_Renderer* const renderer,
-    int dx, int dy) {
-
-  // draw one tile
-  for (int sy = 0; sy < 8; ++sy) {
-    int tdx = dx;
-    // draw only first row
-    for (int sx = 0; sx < 8; ++sx) {
-      if (tile_data[sx]) {
-        SDL_RenderDrawPoint(renderer, tdx, dy);
-      }
-      ++tdx;
+// Registers are read once per line, straight out of memory.
+static void draw_scanline (struct lcd* const lcd) {
+  const uint8_t* const vram = lcd->mmu->vram;
+  const uint8_t* const io = lcd->mmu->io;
+  const uint8_t lcdc = io[0x40];
+  const uint8_t scy = io[0x42];
+  const uint8_t scx = io[0x43];
+  const uint8_t bgp = io[0x47];
+  const uint8_t wy = io[0x4A];
+  const int wx = io[0x4B] - 7;
+  const uint8_t ly = lcd->line;
+  // Palette numbers before BGP, which sprite priority looks at.
+  uint8_t bg [SCREEN_WIDTH];
+
+  if (lcdc & (1 << 0)) {
+    const uint8_t y = scy + ly;
+    const uint8_t* const map =
+      &vram[(lcdc & (1 << 3)) ? 0x1C00 : 0x1800] + (y >> 3) * 32;
+    draw_tiles(lcd, lcdc, map, y, scx, 0, bg);
+    if ((lcdc & (1 << 5)) && ly >= wy && wx < SCREEN_WIDTH) {
+      const uint8_t y = lcd->window_line++;
+      const uint8_t* const map =
+        &vram[(lcdc & (1 << 6)) ? 0x1C00 : 0x1800] + (y >> 3) * 32;
+      // A window left of the screen starts part way into its first tile.
+      const int x = wx < 0 ? 0 : wx;
+      draw_tiles(lcd, lcdc, map, y, x - wx, x, bg);
     }
-    tile_data += 8;
-    ++dy;
+  } else {
+    memset(bg, 0, sizeof(bg));
   }
-}
-
-static const uint8_t* seek_tile (const uint8_t* tile_data, unsigned int i) {
-  // 256 tiles in total
-  assert(i < 256);
-  // 8px x 8px per tile
-  return tile_data + i * 64;
-}
-
-static void clear_renderer (SDL_Renderer* const renderer) {
-  SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-  SDL_RenderClear(renderer);
-}
-
-static void paint_tiles (const uint8_t* const tile_data,
-    SDL_Renderer* const renderer) {
-  clear_renderer(renderer);
-  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
 
-  // 256 tiles in total
-  for (int tile = 0; tile < 256; ++tile) {
-    // 16 rows, 16 columns, 8px per tile
-    int dx = (tile % 16) * 8;
-    int dy = (tile / 16) * 8;
-    paint_tile(seek_tile(tile_data, tile), renderer, dx, dy);
+  uint8_t* const out = lcd->framebuffer[ly];
+  const uint8_t shades [4] = {
+    bgp & 3, (bgp >> 2) & 3, (bgp >> 4) & 3, (bgp >> 6) & 3,
+  };
+  for (int x = 0; x < SCREEN_WIDTH; ++x) {
+    out[x] = shades[bg[x]];
   }
 
-  SDL_RenderPresent(renderer);
-}
-
-static void map_tiles (const uint8_t* const map_data,
-    const uint8_t* const tile_data, SDL_Renderer* const renderer) {
-  clear_renderer(renderer);
-  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-  for (int map = 0; map < 32 * 32; ++map) {
-    int dx = (map % 32) * 8;
-    int dy = (map / 32) * 8;
-    paint_tile(seek_tile(tile_data, map_data[map]), renderer, dx, dy);
-    /*if (map == 261) {*/
-    /*if (map_data[map]) {*/
-      /*printf("XXX: %d\n", map);*/
-      /*break;*/
-    /*};*/
+  if (lcdc & (1 << 1)) {
+    draw_sprites(lcd, lcdc, bg, out);
   }
-  SDL_RenderPresent(renderer);
 }
 
-static void perror_sdl (const char* const msg) {
-  fprintf(stderr, "%s: %s\n", msg, SDL_GetError());
+void init_lcd (struct lcd* const lcd, struct mmu* const mmu,
+    struct tile_cache* const tiles,
+    uint8_t (* const framebuffer) [SCREEN_WIDTH]) {
+  lcd->mmu = mmu;
+  lcd->tiles = tiles;
+  lcd->framebuffer = framebuffer;
+  decode_tiles(tiles, mmu->vram);
+  mmu->tiles = tiles;
+  lcd->mode = 2;
+  lcd->line = 0;
+  lcd->window_line = 0;
+  lcd->enabled = false;
+  lcd->entered_vblank = false;
+  memset(framebuffer, 0, SCREEN_HEIGHT * sizeof(*framebuffer));
 }
 
-static SDL_Renderer* get_cleared_renderer (SDL_Window* const window) {
-  if (!window) {
-    perror_sdl("unable to open window");
-    return NULL;
-  }
-  SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, 0);
-  if (!renderer) {
-    perror_sdl("unable to create renderer");
-    // TODO: close window?
-    return NULL;
+// http://gameboy.mongenel.com/dmg/gbc_lcdc_timing.txt`
+uint32_t step_lcd (struct lcd* const lcd) {
+  // While off, check back once a line rather than advancing.
+  if (!is_lcd_on(lcd)) {
+    return LINE_CYCLES;
   }
-  SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-  SDL_RenderClear(renderer);
-  SDL_RenderPresent(renderer);
-  return renderer;
-}
-
-void create_debug_windows (struct windows* const windows) {
-  windows->tiles.window =
-    SDL_CreateWindow("Debug Tileset",
-        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 16 * 8, 16 * 8, 0);
-  windows->tiles.renderer = get_cleared_renderer(windows->tiles.window);
-  windows->tilemap.window =
-    SDL_CreateWindow("Debug Tilemapped Tiles",
-        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 32 * 8, 32 * 8, 0);
-  windows->tilemap.renderer = get_cleared_renderer(windows->tilemap.window);
-}
-
-// http://www.huderlem.com/demos/gameboy2bpp.html
-void update_debug_windows (struct windows* const windows,
-    const struct lcd* const lcd) {
 
-  if (!lcd->mmu->tile_data_dirty) {
-    return;
+  switch (lcd->mode) {
+    // HBlank
+    case 0:
+      next_line(lcd);
+      if (lcd->line == 144) {
+        // vblank interrupt
+        wb(lcd->mmu, 0xFF0F, rb(lcd->mmu, 0xFF0F) | 0x01);
+        lcd->entered_vblank = true;
+        transition(lcd, 1);
+        return LINE_CYCLES;
+      }
+      transition(lcd, 2);
+      return OAM_CYCLES;
+    // VBlank
+    case 1:
+      next_line(lcd);
+      if (lcd->line == 0) {
+        lcd->window_line = 0;
+        transition(lcd, 2);
+        return OAM_CYCLES;
+      }
+      return LINE_CYCLES;
+    case 2:
+      transition(lcd, 3);
+      return TRANSFER_CYCLES;
+    case 3:
+      draw_scanline(lcd);
+      transition(lcd, 0);
+      return HBLANK_CYCLES;
+    default:
+      // Not a valid mode
+      assert(false);
+      return LINE_CYCLES;
   }
-  lcd->mmu->tile_data_dirty = 0;
-
-  uint8_t* const tile_data = calloc(8 * 8 * 256, sizeof(uint8_t));
-  shade_tiles(tile_data, lcd);
-  paint_tiles(tile_data, windows->tiles.renderer);
-
-  uint8_t* const map_data = calloc(32 * 32, sizeof(uint8_t));
-  paint_bg_tilemap(map_data, lcd);
-  map_tiles(map_data, tile_data, windows->tilemap.renderer);
-
-  free(tile_data);
-  free(map_data);
-}
-
-void destroy_windows (struct windows* windows) {
-  SDL_DestroyRenderer(windows->tiles.renderer);
-  SDL_DestroyRenderer(windows->tilemap.renderer);
-  SDL_DestroyWindow(windows->tiles.window);
-  SDL_DestroyWindow(windows->tilemap.window);
 }
@@ -2,33 +2,38 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-#include "SDL_render.h"
-#include "SDL_video.h"
 #include "mmu.h"
+#include "tile_cache.h"
+
+// T-cycles spent in each mode of a visible line, and per line overall.
+#define OAM_CYCLES 80
+#define TRANSFER_CYCLES 172
+#define HBLANK_CYCLES 204
+#define LINE_CYCLES 456
+
+#define SCREEN_WIDTH 160
+#define SCREEN_HEIGHT 144
 
 struct lcd {
-  struct mmu* mmu;
-  uint32_t total_cycles; // for debugging?
-  uint16_t cycles_in_current_mode;
-  uint16_t cycles_in_current_line;
   uint8_t mode;
   uint8_t line;
   bool enabled;
+  // Set on reaching line 144, cleared by whoever is waiting for a frame.
+  bool entered_vblank;
+  // Lines of the window drawn so far this frame.
+  uint8_t window_line;
+  struct mmu* mmu;
+  // Kept in step with VRAM by the MMU, for the renderer and debug windows.
+  struct tile_cache* tiles;
+  // Shades 0 (white) to 3 (black), SCREEN_HEIGHT lines drawn one at a time.
+  uint8_t (*framebuffer) [SCREEN_WIDTH];
 };
 
-struct winren {
-  SDL_Window* window;
-  SDL_Renderer* renderer;
-};
-
-struct windows {
-  struct winren main;
-  struct winren tiles;
-  struct winren tilemap;
-};
-
-void update_lcd (struct lcd* const lcd, const uint8_t cycles);
-void create_debug_windows (struct windows* const windows);
-void update_debug_windows (struct windows* const windows,
-    const struct lcd* const lcd);
-void destroy_windows (struct windows* windows);
+// tiles and framebuffer live outside the lcd, being derived state and output
+// rather than machine state.
+void init_lcd (struct lcd* const lcd, struct mmu* const mmu,
+    struct tile_cache* const tiles,
+    uint8_t (* const framebuffer) [SCREEN_WIDTH]);
+// Advances to the next mode transition, returning the T-cycles until the one
+// after it.  Called by the scheduler; see kEventLcd.
+uint32_t step_lcd (struct lcd* const lcd);
@@ -1,77 +1,195 @@
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "SDL.h"
 #include "SDL_video.h"
 
-#include "cpu.h"
-#include "lcd.h"
 #include "logging.h"
+#include "system.h"
+#include "triple_buffer.h"
+#include "window.h"
 
-static int should_exit = 0;
+// Shared by the emulation and presenting threads.
+static atomic_int should_exit = 0;
 static void catch_sig_int(int signum) {
   should_exit = signum == SIGINT;
 }
 
-static int initialize_system (const char* const restrict bios,
-    const char* const restrict rom, struct cpu* const restrict cpu,
-    struct lcd* const restrict lcd) {
-  assert(rom != NULL);
-  assert(cpu != NULL);
-  struct mmu* const mmu = init_memory(bios, rom);
-  if (!mmu) return -1;
-  // TODO: registers get initialized differently based on model
-  init_cpu(cpu, mmu);
-  // TODO: init function
-  lcd->mmu = mmu;
-  lcd->mode = 2;
-  return 0;
+// The DMG's 4194304 Hz clock makes for 59.73 frames a second.
+#define NS_PER_FRAME (CYCLES_PER_FRAME * 1000000000ULL / 4194304)
+// Further behind than this, as after being stopped, and pacing starts over
+// rather than racing to catch up.
+#define MAX_FRAMES_BEHIND 4
+
+struct emulator {
+  struct system* system;
+  struct triple_buffer* frames;
+  // Whether frames should carry VRAM for the debug windows.
+  atomic_bool capture_vram;
+  // Run as fast as the host can instead of at the DMG's frame rate.
+  bool unthrottled;
+};
+
+static uint64_t to_ns (const struct timespec* const ts) {
+  return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// Sleeps until deadline, then moves it on a frame.  Deadlines are absolute,
+// so time lost oversleeping one frame comes out of the next.
+static void wait_for_frame (uint64_t* const deadline) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (to_ns(&now) > *deadline + MAX_FRAMES_BEHIND * NS_PER_FRAME) {
+    *deadline = to_ns(&now);
+  }
+  const struct timespec until = {
+    .tv_sec = *deadline / 1000000000ULL,
+    .tv_nsec = *deadline % 1000000000ULL,
+  };
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) ==
+      EINTR && !should_exit) {
+  }
+  *deadline += NS_PER_FRAME;
+}
+
+// Runs frames at the DMG's rate, or as fast as they come if unthrottled,
+// publishing each complete one and never waiting on the presenter.
+static void* emulate (void* arg) {
+  struct emulator* const emu = arg;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t deadline = to_ns(&start) + NS_PER_FRAME;
+  while (!should_exit) {
+    run_frame(emu->system);
+    // Only complete frames are worth showing.
+    if (emu->system->lcd.entered_vblank) {
+      capture_frame(emu->frames, &emu->system->lcd,
+          atomic_load_explicit(&emu->capture_vram, memory_order_relaxed));
+      publish_frame(emu->frames);
+    }
+    if (!emu->unthrottled) {
+      wait_for_frame(&deadline);
+    }
+  }
+  return NULL;
+}
+
+static void usage (void) {
+  fprintf(stderr, "USAGE: ./pocketgb [-d hz | -D] [-u] [bios.gb] <rom.gb>\n"
+      "  -d hz  refresh the debug windows at most hz times a second\n"
+      "  -D     start with the debug windows off (toggle with d)\n"
+      "  -u     run unthrottled instead of at 59.73 frames a second\n");
 }
 
 int main (int argc, char** argv) {
-  if (argc < 2 || argc > 3) {
-    fprintf(stderr, "USAGE: ./pocketgb [bios.gb] <rom.gb>\n");
+  bool debug_enabled = true;
+  uint32_t debug_hz = 0;
+  bool unthrottled = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:Du")) != -1) {
+    switch (opt) {
+      case 'd':
+        debug_hz = strtoul(optarg, NULL, 10);
+        break;
+      case 'D':
+        debug_enabled = false;
+        break;
+      case 'u':
+        unthrottled = true;
+        break;
+      default:
+        usage();
+        return -1;
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (argc < 1 || argc > 2) {
+    usage();
     return -1;
   }
 
-  struct cpu cpu = { 0 };
-  struct lcd lcd = { 0 };
+  struct system system = { 0 };
   int rc = 0;
-  if (argc == 2) {
+  if (argc == 1) {
     // If just the bios is passed, init_cpu will look at rom size and not jump
     // the pc forward.
-    rc = initialize_system(NULL, argv[1], &cpu, &lcd);
+    rc = init_system(NULL, argv[0], true, &system);
   } else {
-    rc = initialize_system(argv[1], argv[2], &cpu, &lcd);
+    rc = init_system(argv[0], argv[1], true, &system);
   }
   if (rc) {
     fprintf(stderr, "Failed to initialize system.\n");
     return -1;
   }
+  // Show test ROM output as it comes.
+  system.cpu.mmu->serial.echo = true;
   if(signal(SIGINT, catch_sig_int) == SIG_ERR) {
     perror("Unable to set SIGINT handler.\n");
   }
 
   assert(SDL_Init(SDL_INIT_VIDEO) == 0);
   struct windows windows;
-  create_debug_windows(&windows);
+  create_windows(&windows, debug_enabled, debug_hz);
   SDL_Event e;
 
-  // TODO: while cpu not halted
-  while (1) {
-    SDL_PollEvent(&e);
-    if (should_exit || e.type == SDL_QUIT) {
-      break;
+  // Large, and shared with the emulation thread.
+  struct triple_buffer* const frames = malloc(sizeof(*frames));
+  assert(frames);
+  init_triple_buffer(frames);
+  struct emulator emu = {
+    .system = &system,
+    .frames = frames,
+    .unthrottled = unthrottled,
+  };
+  atomic_init(&emu.capture_vram, debug_enabled);
+  pthread_t emulation;
+  // Only a thread that started can be joined.
+  const bool emulating = !pthread_create(&emulation, NULL, emulate, &emu);
+  if (!emulating) {
+    fprintf(stderr, "Failed to start emulation thread.\n");
+    should_exit = 1;
+  }
+
+  // SDL wants windows handled on the thread that made them, so this one
+  // presents while the emulation runs on its own.
+  while (!should_exit) {
+    while (SDL_PollEvent(&e)) {
+      if (e.type == SDL_QUIT) {
+        should_exit = 1;
+      } else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_d) {
+        set_debug_windows(&windows, !windows.debug_enabled);
+        atomic_store_explicit(&emu.capture_vram, windows.debug_enabled,
+            memory_order_relaxed);
+      }
     }
 
-    tick_once(&cpu);
-    update_lcd(&lcd, cpu.tick_cycles);
-    update_debug_windows(&windows, &lcd);
+    // Frames published since the last pass are simply skipped.
+    const struct frame* const frame = acquire_frame(frames);
+    if (!frame) {
+      SDL_Delay(1);
+      continue;
+    }
+    update_main_window(&windows, frame);
+    if (windows.debug_enabled) {
+      update_debug_windows(&windows, frame);
+    }
+  }
+  if (emulating) {
+    pthread_join(emulation, NULL);
   }
+  free(frames);
 
   destroy_windows(&windows);
   SDL_Quit();
-  deinit_memory(cpu.mmu);
+  deinit_system(&system);
   printf("\nexiting cleanly\n");
 }
@@ -5,30 +5,23 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "block_cache.h"
 #include "logging.h"
+#include "scheduler.h"
+#include "tile_cache.h"
+#include "timer.h"
 
-static void handle_hardware_io_side_effects(struct mmu* const mem,
+static uint8_t handle_hardware_io_side_effects(struct mmu* const mem,
     const uint16_t addr, const uint8_t val);
-static void handle_tile_write (const uint16_t addr);
+static void handle_tile_write (struct mmu* const mem, const uint16_t addr,
+    const uint8_t val);
 
-uint8_t rb (const struct mmu* const mem, const uint16_t addr) {
-  // todo: fancy case statement
-  switch (addr & 0xF000) {
-    case 0xE000:
-      LOG(7, "read from echo ram\n");
-      return rb(mem, addr - 0x2000);
-    case 0xF000:
-      switch (addr & 0x0F00) {
-        case 0x0E00:
-        case 0x0F00:
-          break;
-        default:
-          LOG(7, "read from echo ram\n");
-          return rb(mem, addr - 0x2000);
-      }
-      break;
-  }
-  return mem->memory[addr];
+extern inline uint8_t rb (const struct mmu* const mem, const uint16_t addr);
+
+// Only cartridge RAM gets unmapped for reads, when disabled or showing the
+// RTC.
+uint8_t read_slow (const struct mmu* const mem, const uint16_t addr) {
+  return cart_ram_read(mem, addr);
 }
 
 uint16_t rw (const struct mmu* const mem, const uint16_t addr) {
@@ -36,31 +29,73 @@ uint16_t rw (const struct mmu* const mem, const uint16_t addr) {
 }
 
 void wb (struct mmu* const mem, const uint16_t addr, const uint8_t val) {
+  uint8_t* const page = mem->write_pages[addr >> 8];
+  if (__builtin_expect(page != NULL, 1)) {
+    if (mem->blocks && is_cached_code(mem->blocks, addr)) {
+      invalidate_code(mem->blocks, addr);
+    }
+    page[addr & 0xFF] = val;
+    return;
+  }
+  write_slow(mem, addr, val);
+}
+
+// The array behind a page outside the cartridge's windows.
+static uint8_t* page_backing (struct mmu* const mem, const int page) {
+  if (page < 0xA0) return &mem->vram[(page - 0x80) << 8];
+  // 0xE000-0xFDFF echoes 0xC000-0xDDFF.
+  if (page < 0xFE) return &mem->wram[((page - 0xC0) & 0x1F) << 8];
+  return page == 0xFE ? mem->oam : mem->high;
+}
+
+// Writes to pages left out of write_pages.
+void write_slow (struct mmu* const mem, const uint16_t addr,
+    const uint8_t val) {
+  // Neither of these changes any code.
+  if (addr < 0x8000) {
+    mbc_write(mem, addr, val);
+    return;
+  }
+  if (addr >= 0xA000 && addr < 0xC000) {
+    cart_ram_write(mem, addr, val);
+    return;
+  }
+  if (mem->blocks && is_cached_code(mem->blocks, addr)) {
+    invalidate_code(mem->blocks, addr);
+  }
+  // HRAM shares the IO page but has no side effects; only 0xFF00-0xFF7F and
+  // IE need the switch below.
+  if (addr >= 0xFF80 && addr < 0xFFFF) {
+    mem->high[addr & 0xFF] = val;
+    return;
+  }
   switch (addr & 0xF000) {
     case 0x8000:
     case 0x9000: // intentional fallthrough
-      handle_tile_write(addr);
-      mem->tile_data_dirty = 1;
-      break;
-    case 0xE000:
-      // echo ram
-      LOG(7, "write to echo ram\n");
-      return wb(mem, addr - 0x2000, val);
+      handle_tile_write(mem, addr, val);
+      return;
     case 0xF000:
-      switch (addr & 0x0F00) {
-        case 0x0E00:
-          break;
-        case 0x0F00:
-          handle_hardware_io_side_effects(mem, addr, val);
-          break;
-        default:
-          // echo ram
-          LOG(7, "write to echo ram\n");
-          return wb(mem, addr - 0x2000, val);
-      }
-      break;
+      assert(addr >= 0xFF00);
+      mem->high[addr & 0xFF] = handle_hardware_io_side_effects(mem, addr, val);
+      return;
   }
-  mem->memory[addr] = val;
+  page_backing(mem, addr >> 8)[addr & 0xFF] = val;
+}
+
+// ROM writes go to the MBC, and VRAM and IO writes have side effects.  The
+// cartridge maps its own ROM and RAM windows.
+static void map_pages (struct mmu* const mem) {
+  for (int page = 0x80; page < 256; ++page) {
+    if (page >= 0xA0 && page < 0xC0) continue;
+    uint8_t* const memory = page_backing(mem, page);
+    mem->read_pages[page] = memory;
+    const int slow = page < 0xA0 || page == 0xFF;
+    mem->write_pages[page] = slow ? NULL : memory;
+  }
+  for (int page = 0; page < 0x80; ++page) {
+    mem->write_pages[page] = NULL;
+  }
+  map_cartridge(mem);
 }
 
 void ww (struct mmu* const mem, const uint16_t addr, const uint16_t val) {
@@ -84,8 +119,8 @@ static size_t get_filesize (FILE* f) {
 
 // return 0 on success
 static int read_file_into_memory (const char* const path, void* dest,
-    size_t* const rom_size) {
-  printf("opening %s\n", path);
+    const size_t max_size) {
+  LOG(1, "opening %s\n", path);
   FILE* f = fopen(path, "r");
   if (!f) {
     fprintf(stderr, "failed to open %s\n", path);
@@ -96,12 +131,7 @@ static int read_file_into_memory (const char* const path, void* dest,
     fprintf(stderr, "%s appears to be an empty file\n", path);
     goto fclose;
   }
-  if (rom_size) {
-    *rom_size = fsize;
-  }
-  // only the first 0x7FFF bytes get mapped in, otherwise a memory bank
-  // controller must be used
-  fsize = fsize < 0x7FFF ? fsize : 0x7FFF;
+  fsize = fsize < max_size ? fsize : max_size;
 
   size_t read = fread(dest, 1, fsize, f);
   if (read != fsize) goto fclose;
@@ -113,43 +143,54 @@ error:
 }
 
 // http://gameboy.mongenel.com/dmg/asmmemmap.html
-// Returns NULL on error
 // bios may be null
 // rom must not be
-struct mmu* init_memory (const char* const restrict bios,
-    const char* const restrict rom) {
+int init_memory (struct mmu* const restrict mmu,
+    const char* const restrict bios, const char* const restrict rom,
+    const bool persist_saves) {
+  assert(mmu != NULL);
   assert(rom != NULL);
-  struct mmu* const mmu = malloc(sizeof(struct mmu));
-  if (!mmu) goto error;
 #ifndef NDEBUG
-  memset(mmu->memory, 0xF7, sizeof(mmu->memory));
+  memset(mmu->wram, 0xF7, sizeof(mmu->wram));
+  memset(mmu->vram, 0xF7, sizeof(mmu->vram));
+  memset(mmu->oam, 0xF7, sizeof(mmu->oam));
+  memset(mmu->high, 0xF7, sizeof(mmu->high));
 #endif
-  int rc = read_file_into_memory(rom, mmu->memory, &mmu->rom_size);
-  if (rc) goto free;
-  if (bios) {
-    memcpy(mmu->rom_masked_by_bios, mmu->memory, sizeof(mmu->rom_masked_by_bios));
-    rc = read_file_into_memory(bios, mmu->memory, NULL);
-    if (rc) goto free;
+  if (load_cartridge(&mmu->cart, rom, persist_saves)) return -1;
+  if (bios && read_file_into_memory(bios, mmu->bios, sizeof(mmu->bios))) {
+    unload_cartridge(&mmu->cart);
+    return -1;
   }
   mmu->has_bios = !!bios;
-  mmu->tile_data_dirty = 1;
-  return mmu;
-free:
-  free(mmu);
-error:
-  return NULL;
+  mmu->bios_mapped = !!bios;
+  memset(&mmu->vram_dirty, 0xFF, sizeof(mmu->vram_dirty));
+  mmu->tiles = NULL;
+  mmu->blocks = NULL;
+  mmu->scheduler = NULL;
+  memset(&mmu->serial, 0, sizeof(mmu->serial));
+  mmu->buttons = 0;
+  // Nothing selected, nothing pressed.
+  mmu->io[0x00] = 0xCF;
+  map_pages(mmu);
+  return 0;
 }
 
 void deinit_memory (struct mmu* const mem) {
   if (mem) {
-    free(mem);
+    unload_cartridge(&mem->cart);
+    free(mem->serial.data);
+    mem->serial.data = NULL;
   }
 }
 
 
 static void power_up_sequence (struct mmu* const mem) {
   // remove the BIOS
-  memcpy(mem, mem->rom_masked_by_bios, 256);
+  mem->bios_mapped = 0;
+  map_cartridge(mem);
+  if (mem->blocks) {
+    flush_block_cache(mem->blocks);
+  }
   wb(mem, 0xFF05, 0x00); // TIMA
   wb(mem, 0xFF06, 0x00); // TMA
   wb(mem, 0xFF07, 0x00); // TAC
@@ -186,21 +227,99 @@ static void power_up_sequence (struct mmu* const mem) {
   wb(mem, 0xFFFF, 0x00); // IE
 }
 
+// Records a verdict if the line just ended starts with Passed or Failed.
+static void check_verdict (struct serial* const serial) {
+  const char* const line = serial->data + serial->line_start;
+  const size_t length = serial->length - serial->line_start;
+  if (length >= 6 && !memcmp(line, "Passed", 6)) {
+    serial->verdict = kVerdictPassed;
+  } else if (length >= 6 && !memcmp(line, "Failed", 6)) {
+    serial->verdict = kVerdictFailed;
+  }
+}
+
+static void serial_send (struct serial* const serial, const uint8_t byte) {
+  if (serial->echo) {
+    putchar(byte);
+  }
+  if (serial->length == serial->capacity) {
+    const size_t capacity = serial->capacity ? serial->capacity * 2 : 256;
+    char* const data = realloc(serial->data, capacity);
+    if (!data) {
+      LOG(1, "dropping serial output\n");
+      return;
+    }
+    serial->data = data;
+    serial->capacity = capacity;
+  }
+  serial->data[serial->length++] = byte;
+  if (byte == '\n') {
+    if (serial->verdict == kVerdictNone) {
+      check_verdict(serial);
+    }
+    serial->line_start = serial->length;
+  }
+}
+
+// P1 as read back: select bits as written, and a 0 for each pressed button
+// on a selected line.
+static uint8_t joypad_value (const uint8_t buttons, const uint8_t select) {
+  uint8_t lines = 0x0F;
+  if (!(select & 0x10)) lines &= ~(buttons & 0x0F);
+  if (!(select & 0x20)) lines &= ~(buttons >> 4);
+  return 0xC0 | (select & 0x30) | lines;
+}
+
+void set_buttons (struct mmu* const mem, const uint8_t buttons) {
+  const uint8_t old = mem->io[0x00];
+  const uint8_t val = joypad_value(buttons, old);
+  mem->buttons = buttons;
+  mem->io[0x00] = val;
+  if (old & ~val & 0x0F) {
+    wb(mem, 0xFF0F, rb(mem, 0xFF0F) | (1 << 4));
+  }
+}
+
+// T-cycles to shift out 8 bits at 8192Hz.
+#define SERIAL_TRANSFER_CYCLES 4096
+
 // if 1XXX,XXXX is written to 0xFF02, start transfer of 0xFF01
 static void sc_write (struct mmu* const mem, const uint8_t val) {
   if (val & 0x80) {
     /*LOG(1, "putting " PRIbyte "\n", rb(mem, 0xFF01));*/
     /*putchar(rb(mem, 0xFF01));*/
     /*printf("%c\n", rb(mem, 0xFF01));*/
-    putchar(rb(mem, 0xFF01));
+    // The byte is latched now; the transfer completes later.
+    serial_send(&mem->serial, rb(mem, 0xFF01));
+    if (mem->scheduler) {
+      schedule_event(mem->scheduler, kEventSerial,
+          mem->scheduler->now + SERIAL_TRANSFER_CYCLES);
+    }
   } else {
     LOG(8, "not putting\n");
   }
 }
 
-static void handle_hardware_io_side_effects(struct mmu* const mem,
+void on_serial_event (struct mmu* const mem) {
+  mem->io[0x02] &= ~0x80;
+  wb(mem, 0xFF0F, rb(mem, 0xFF0F) | 0x08);
+}
+
+// Copies the 0xA0 bytes of sprite attributes at val << 8 into OAM.  This
+// takes 160 M-cycles on hardware, but is done all at once here.
+static void oam_dma (struct mmu* const mem, const uint8_t val) {
+  const uint16_t src = val << 8;
+  for (int i = 0; i < 0xA0; ++i) {
+    mem->oam[i] = rb(mem, src + i);
+  }
+}
+
+// Returns the value to actually store at addr.
+static uint8_t handle_hardware_io_side_effects(struct mmu* const mem,
     const uint16_t addr, const uint8_t val) {
   switch (addr) {
+    case 0xFF00:
+      return joypad_value(mem->buttons, val);
     case 0xFF01:
       LOG(7, "data written to SB " PRIbyte " " PRIshort "\n", val, addr);
       break;
@@ -208,12 +327,29 @@ static void handle_hardware_io_side_effects(struct mmu* const mem,
       LOG(7, "data written to SC " PRIbyte " " PRIshort "\n", val, addr);
       sc_write(mem, val);
       break;
+    case 0xFF04:
+      LOG(7, "data written to DIV " PRIbyte "\n", val);
+      if (mem->scheduler) {
+        div_write(mem);
+      }
+      return 0;
+    case 0xFF07:
+      LOG(7, "data written to TAC " PRIbyte "\n", val);
+      if (mem->scheduler) {
+        tac_write(mem, val);
+      }
+      break;
     case 0xFF0F:
       LOG(7, "data written to IF " PRIbyte " @ " PRIshort "\n", val, addr);
+      schedule_interrupt_check(mem->scheduler);
       break;
     case 0xFF40:
       LOG(7, "write to LCDC: %d\n", val);
       break;
+    case 0xFF46:
+      LOG(7, "OAM DMA from " PRIshort "\n", val << 8);
+      oam_dma(mem, val);
+      break;
     case 0xFF50:
       // TODO: check val
       LOG(7, "write to 0xFF50");
@@ -221,14 +357,43 @@ static void handle_hardware_io_side_effects(struct mmu* const mem,
       break;
     case 0xFFFF:
       LOG(7, "data written to IE " PRIbyte " @ " PRIshort "\n", val, addr);
+      schedule_interrupt_check(mem->scheduler);
       break;
     default:
       break;
   }
+  return val;
 }
 
 
-static void handle_tile_write (const uint16_t addr) {
+bool take_vram_dirty (struct mmu* const mem, struct vram_dirty* const into) {
+  uint64_t any = 0;
+  for (size_t i = 0; i < VRAM_TILES / 64; ++i) {
+    any |= mem->vram_dirty.tiles[i];
+    into->tiles[i] |= mem->vram_dirty.tiles[i];
+  }
+  for (size_t i = 0; i < VRAM_MAP_ENTRIES / 64; ++i) {
+    any |= mem->vram_dirty.maps[i];
+    into->maps[i] |= mem->vram_dirty.maps[i];
+  }
+  memset(&mem->vram_dirty, 0, sizeof(mem->vram_dirty));
+  return any != 0;
+}
+
+// Stores val and brings the decoded copy of its tile row up to date.
+static void handle_tile_write (struct mmu* const mem, const uint16_t addr,
+    const uint8_t val) {
+  mem->vram[addr - 0x8000] = val;
+  if (addr <= 0x97FF) {
+    if (mem->tiles) {
+      decode_tile_row(mem->tiles, mem->vram, addr - 0x8000);
+    }
+    const unsigned tile = (addr - 0x8000) >> 4;
+    mem->vram_dirty.tiles[tile / 64] |= 1ULL << (tile % 64);
+  } else {
+    const unsigned entry = addr - 0x9800;
+    mem->vram_dirty.maps[entry / 64] |= 1ULL << (entry % 64);
+  }
   if (addr <= 0x87FF) {
     LOG(4, "write to tile set #1 %X\n", addr);
   } else if (addr <= 0x8FFF) {
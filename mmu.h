@@ -1,25 +1,121 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
+#include "cartridge.h"
 #include "cpu.h"
 
+struct block_cache;
+struct scheduler;
+struct tile_cache;
+
+// 384 tiles of 16 bytes at 0x8000-0x97FF, then the two 32x32 tilemaps at
+// 0x9800-0x9BFF and 0x9C00-0x9FFF.
+#define VRAM_TILES 384
+#define VRAM_MAP_ENTRIES 2048
+
+// A bit per tile and per tilemap entry written since a consumer last looked.
+struct vram_dirty {
+  uint64_t tiles [VRAM_TILES / 64];
+  uint64_t maps [VRAM_MAP_ENTRIES / 64];
+};
+
+// Everything sent over the serial port, which is how blargg's test ROMs
+// report results.
+struct serial {
+  char* data;
+  size_t length;
+  size_t capacity;
+  // Where the line being sent starts in data.
+  size_t line_start;
+  // Also copy each byte to stdout as it's sent.
+  bool echo;
+  // Set by the first line starting "Passed" or "Failed".
+  enum __attribute__((packed)) SerialVerdict {
+    kVerdictNone,
+    kVerdictPassed,
+    kVerdictFailed,
+  } verdict;
+};
+
+// Bits of mmu.buttons; the low nibble is read through P14, the high through
+// P15.
+enum __attribute__((packed)) Button {
+  kButtonRight = 1 << 0,
+  kButtonLeft = 1 << 1,
+  kButtonUp = 1 << 2,
+  kButtonDown = 1 << 3,
+  kButtonA = 1 << 4,
+  kButtonB = 1 << 5,
+  kButtonSelect = 1 << 6,
+  kButtonStart = 1 << 7,
+};
+
 // http://gameboy.mongenel.com/dmg/asmmemmap.html
+// Only what the machine has: ROM and cartridge RAM are the cartridge's, and
+// echo RAM is mapped onto wram.
 struct mmu {
-  uint8_t memory [65536];
-  // the BIOS covers this until write to 0xFF50
-  uint8_t rom_masked_by_bios [256];
+  uint8_t wram [0x2000];
+  uint8_t vram [0x2000];
+  // OAM proper is the first 0xA0 bytes; the rest backs 0xFEA0-0xFEFF.
+  uint8_t oam [0x100];
+  // 0xFF00-0xFFFF, which the page tables treat as one page.
+  union {
+    uint8_t high [0x100];
+    struct {
+      uint8_t io [0x80];
+      uint8_t hram [0x7F];
+      uint8_t ie;
+    };
+  };
+  // the BIOS covers 0x0000-0x00FF until write to 0xFF50
+  uint8_t bios [256];
   int has_bios;
-  size_t rom_size;
-  int tile_data_dirty;
+  int bios_mapped;
+  // Held buttons, kButton* bits.
+  uint8_t buttons;
+  struct cartridge cart;
+  struct vram_dirty vram_dirty;
+  struct serial serial;
+  // Decoded tiles to keep in step with VRAM, if anything wants them.
+  struct tile_cache* tiles;
+  // Decoded code to invalidate on writes, if the CPU caches any.
+  struct block_cache* blocks;
+  // Where IO writes post timer, serial and interrupt events.
+  struct scheduler* scheduler;
+  // Backing memory for each 256 byte page, or NULL if accessing the page has
+  // side effects and must go through the slow path.
+  const uint8_t* read_pages [256];
+  uint8_t* write_pages [256];
 };
 
-__attribute__((nonnull(2)))
-struct mmu* init_memory (const char* const restrict bios,
-    const char* const restrict rom) ;
+// Returns 0 on success
+__attribute__((nonnull(1, 3)))
+int init_memory (struct mmu* const restrict mmu,
+    const char* const restrict bios, const char* const restrict rom,
+    const bool persist_saves);
 void deinit_memory (struct mmu* const);
-uint8_t rb (const struct mmu* const mem, uint16_t addr);
+uint8_t read_slow (const struct mmu* const mem, const uint16_t addr);
+void write_slow (struct mmu* const mem, const uint16_t addr, const uint8_t val);
+
+inline uint8_t rb (const struct mmu* const mem, const uint16_t addr) {
+  const uint8_t* const page = mem->read_pages[addr >> 8];
+  if (__builtin_expect(page != NULL, 1)) {
+    return page[addr & 0xFF];
+  }
+  return read_slow(mem, addr);
+}
+
 uint16_t rw (const struct mmu* const mem, uint16_t addr);
 void wb (struct mmu* const mem, const uint16_t addr, const uint8_t val);
 void ww (struct mmu* const mem, const uint16_t addr, const uint16_t val);
+// Presses exactly the kButton* bits in buttons, requesting the joypad
+// interrupt if that pulls a selected line low.
+void set_buttons (struct mmu* const mem, const uint8_t buttons);
+// Adds the VRAM dirty bitmap to into and clears it, returning whether
+// anything was set.
+bool take_vram_dirty (struct mmu* const mem, struct vram_dirty* const into);
+// Completes a serial transfer started by a write to SC.
+void on_serial_event (struct mmu* const mem);
@@ -0,0 +1,98 @@
+#include "pocketgb.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "state.h"
+#include "system.h"
+
+struct gb_system {
+  struct system system;
+};
+
+_Static_assert(GB_SCREEN_WIDTH == SCREEN_WIDTH &&
+    GB_SCREEN_HEIGHT == SCREEN_HEIGHT, "screen size mismatch");
+_Static_assert(GB_BUTTON_RIGHT == kButtonRight &&
+    GB_BUTTON_START == kButtonStart, "button bits mismatch");
+
+struct gb_system* gb_create (const char* const bios, const char* const rom,
+    const bool persist_saves) {
+  if (!rom) return NULL;
+  // Keeps the hot start of the system on one cache line.
+  struct gb_system* const gb = aligned_alloc(_Alignof(struct gb_system),
+      sizeof(*gb));
+  if (!gb) return NULL;
+  memset(gb, 0, sizeof(*gb));
+  if (init_system(bios, rom, persist_saves, &gb->system)) {
+    free(gb);
+    return NULL;
+  }
+  return gb;
+}
+
+void gb_destroy (struct gb_system* const gb) {
+  if (gb) {
+    deinit_system(&gb->system);
+    free(gb);
+  }
+}
+
+uint32_t gb_run_frame (struct gb_system* const gb) {
+  return run_frame(&gb->system);
+}
+
+uint32_t gb_run_cycles (struct gb_system* const gb, const uint32_t cycles) {
+  return run_cycles(&gb->system, cycles);
+}
+
+void gb_set_buttons (struct gb_system* const gb, const uint8_t buttons) {
+  set_buttons(gb->system.cpu.mmu, buttons);
+}
+
+uint64_t gb_cycles (const struct gb_system* const gb) {
+  return gb->system.scheduler.now;
+}
+
+const uint8_t* gb_framebuffer (const struct gb_system* const gb) {
+  return &gb->system.lcd.framebuffer[0][0];
+}
+
+const char* gb_serial_output (const struct gb_system* const gb,
+    size_t* const length) {
+  const struct serial* const serial = serial_output(&gb->system);
+  *length = serial->length;
+  return serial->data;
+}
+
+enum gb_verdict gb_serial_verdict (const struct gb_system* const gb) {
+  switch (serial_output(&gb->system)->verdict) {
+    case kVerdictPassed:
+      return kGbPassed;
+    case kVerdictFailed:
+      return kGbFailed;
+    default:
+      return kGbNoVerdict;
+  }
+}
+
+size_t gb_state_size (const struct gb_system* const gb) {
+  return state_size(&gb->system);
+}
+
+size_t gb_save_state (struct gb_system* const gb, void* const buf,
+    const size_t size) {
+  return save_state(&gb->system, buf, size);
+}
+
+int gb_load_state (struct gb_system* const gb, const void* const buf,
+    const size_t size) {
+  return load_state(&gb->system, buf, size);
+}
+
+int gb_save_state_file (struct gb_system* const gb, const char* const path) {
+  return save_state_file(&gb->system, path);
+}
+
+int gb_load_state_file (struct gb_system* const gb, const char* const path) {
+  return load_state_file(&gb->system, path);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The embedding API.  Instances share nothing but read only ROM images, so a
+// process can run as many as it likes, each on whichever thread, one thread
+// at a time.
+
+// libpocketgb exports nothing else.
+#define GB_EXPORT __attribute__((visibility("default")))
+
+#define GB_SCREEN_WIDTH 160
+#define GB_SCREEN_HEIGHT 144
+
+struct gb_system;
+
+// Bits for gb_set_buttons.
+#define GB_BUTTON_RIGHT (1 << 0)
+#define GB_BUTTON_LEFT (1 << 1)
+#define GB_BUTTON_UP (1 << 2)
+#define GB_BUTTON_DOWN (1 << 3)
+#define GB_BUTTON_A (1 << 4)
+#define GB_BUTTON_B (1 << 5)
+#define GB_BUTTON_SELECT (1 << 6)
+#define GB_BUTTON_START (1 << 7)
+
+enum gb_verdict {
+  kGbNoVerdict,
+  kGbPassed,
+  kGbFailed,
+};
+
+// Returns NULL on error.  bios may be NULL.  Battery RAM is only written back
+// to a .sav next to the ROM if persist_saves, so that instances of the same
+// ROM don't share it.
+GB_EXPORT struct gb_system* gb_create (const char* const bios,
+    const char* const rom, const bool persist_saves);
+GB_EXPORT void gb_destroy (struct gb_system* const gb);
+
+// Run until the next VBlank, or for a frame's worth of cycles if the LCD is
+// off, returning the T-cycles elapsed.
+GB_EXPORT uint32_t gb_run_frame (struct gb_system* const gb);
+// Run for at least cycles T-cycles, returning how many actually elapsed.
+GB_EXPORT uint32_t gb_run_cycles (struct gb_system* const gb,
+    const uint32_t cycles);
+// Holds exactly the GB_BUTTON_* bits in buttons until the next call.
+GB_EXPORT void gb_set_buttons (struct gb_system* const gb,
+    const uint8_t buttons);
+// T-cycles run since gb_create.
+GB_EXPORT uint64_t gb_cycles (const struct gb_system* const gb);
+
+// The last frame drawn, a byte per pixel of shades 0 (white) to 3 (black),
+// row by row.
+GB_EXPORT const uint8_t* gb_framebuffer (const struct gb_system* const gb);
+// Everything sent over serial so far; not NUL terminated.
+GB_EXPORT const char* gb_serial_output (const struct gb_system* const gb,
+    size_t* const length);
+// Whether the serial output has reported a blargg-style test result.
+GB_EXPORT enum gb_verdict gb_serial_verdict (const struct gb_system* const gb);
+
+// Snapshots of everything the machine can change, including cartridge RAM
+// but not the framebuffer or serial output.  They're versioned, and only load
+// into a system running the same cartridge.
+GB_EXPORT size_t gb_state_size (const struct gb_system* const gb);
+// buf must be aligned as malloc's are.  Returns the bytes written, or 0 if
+// size is too small.
+GB_EXPORT size_t gb_save_state (struct gb_system* const gb, void* const buf,
+    const size_t size);
+// Returns 0 on success; on failure the system is left alone.
+GB_EXPORT int gb_load_state (struct gb_system* const gb, const void* const buf,
+    const size_t size);
+// The same bytes, in a file.  Return 0 on success.
+GB_EXPORT int gb_save_state_file (struct gb_system* const gb,
+    const char* const path);
+GB_EXPORT int gb_load_state_file (struct gb_system* const gb,
+    const char* const path);
@@ -0,0 +1,180 @@
+#include "rom_registry.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+#define ROM_BANK_SIZE 0x4000
+
+struct rom_entry {
+  // First, so a rom_image* is a rom_entry*.
+  struct rom_image image;
+  bool mapped;
+  // The file it was loaded from, so reopening it needn't hash it again.
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  unsigned refs;
+  struct rom_entry* next;
+};
+
+// The one piece of process-wide state: images are immutable once loaded, so
+// only the list itself and the reference counts need the lock.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rom_entry* registry = NULL;
+
+static bool same_file (const struct rom_entry* const e,
+    const struct stat* const st) {
+  return e->dev == st->st_dev && e->ino == st->st_ino &&
+    e->image.file_size == (size_t)st->st_size &&
+    e->mtime.tv_sec == st->st_mtim.tv_sec &&
+    e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static bool same_contents (const struct rom_entry* const a,
+    const struct rom_entry* const b) {
+  return a->image.hash == b->image.hash &&
+    a->image.length == b->image.length &&
+    a->image.file_size == b->image.file_size &&
+    !memcmp(a->image.data, b->image.data, a->image.length);
+}
+
+// FNV-1a a word at a time; lengths are whole banks.
+static uint64_t hash_image (const struct rom_image* const image) {
+  uint64_t hash = 0xCBF29CE484222325;
+  for (size_t i = 0; i < image->length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, image->data + i, sizeof(word));
+    hash = (hash ^ word) * 0x100000001B3;
+  }
+  return hash;
+}
+
+// Whole banks of the file get mapped in directly.  Anything smaller than two
+// banks, or not a multiple of the bank size, is copied and padded instead.
+// Returns 0 on success
+static int load_image (struct rom_entry* const e, const int fd,
+    const size_t size) {
+  e->image.file_size = size;
+  if (size >= 2 * ROM_BANK_SIZE && size % ROM_BANK_SIZE == 0) {
+    void* const rom = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (rom == MAP_FAILED) {
+      perror("mmap");
+      return -1;
+    }
+    e->image.data = rom;
+    e->image.length = size;
+    e->mapped = true;
+  } else {
+    size_t length = (size + ROM_BANK_SIZE - 1) & ~(size_t)(ROM_BANK_SIZE - 1);
+    length = length < 2 * ROM_BANK_SIZE ? 2 * ROM_BANK_SIZE : length;
+    uint8_t* const rom = malloc(length);
+    if (!rom) return -1;
+    memset(rom, 0xFF, length);
+    if (read(fd, rom, size) != (ssize_t)size) {
+      free(rom);
+      return -1;
+    }
+    e->image.data = rom;
+    e->image.length = length;
+    e->mapped = false;
+  }
+  return 0;
+}
+
+static void free_entry (struct rom_entry* const e) {
+  if (e->mapped) {
+    munmap((void*)e->image.data, e->image.length);
+  } else {
+    free((void*)e->image.data);
+  }
+  free(e);
+}
+
+// Call with the lock held.
+static struct rom_entry* find_file (const struct stat* const st) {
+  for (struct rom_entry* e = registry; e; e = e->next) {
+    if (same_file(e, st)) return e;
+  }
+  return NULL;
+}
+
+const struct rom_image* acquire_rom (const char* const path) {
+  LOG(1, "opening %s\n", path);
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "failed to open %s\n", path);
+    return NULL;
+  }
+  struct rom_entry* found = NULL;
+  struct rom_entry* fresh = NULL;
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size <= 0) {
+    fprintf(stderr, "%s appears to be an empty file\n", path);
+    goto close;
+  }
+
+  pthread_mutex_lock(&registry_lock);
+  found = find_file(&st);
+  if (found) ++found->refs;
+  pthread_mutex_unlock(&registry_lock);
+  if (found) goto close;
+
+  // Load and hash outside the lock; another thread may race us to it.
+  fresh = calloc(1, sizeof(*fresh));
+  if (!fresh) goto close;
+  if (load_image(fresh, fd, st.st_size)) {
+    free(fresh);
+    fresh = NULL;
+    goto close;
+  }
+  fresh->image.hash = hash_image(&fresh->image);
+  fresh->dev = st.st_dev;
+  fresh->ino = st.st_ino;
+  fresh->mtime = st.st_mtim;
+  fresh->refs = 1;
+
+  pthread_mutex_lock(&registry_lock);
+  found = find_file(&st);
+  for (struct rom_entry* e = registry; e && !found; e = e->next) {
+    if (same_contents(e, fresh)) found = e;
+  }
+  if (found) {
+    ++found->refs;
+  } else {
+    fresh->next = registry;
+    registry = fresh;
+  }
+  pthread_mutex_unlock(&registry_lock);
+  if (found) {
+    LOG(1, "%s is already loaded\n", path);
+    free_entry(fresh);
+  } else {
+    found = fresh;
+  }
+close:
+  close(fd);
+  return found ? &found->image : NULL;
+}
+
+void release_rom (const struct rom_image* const image) {
+  if (!image) return;
+  struct rom_entry* const entry = (struct rom_entry*)image;
+  pthread_mutex_lock(&registry_lock);
+  const bool last = !--entry->refs;
+  if (last) {
+    struct rom_entry** link = &registry;
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+  }
+  pthread_mutex_unlock(&registry_lock);
+  if (last) free_entry(entry);
+}
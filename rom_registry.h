@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A ROM image as cartridges see it: whole 16 KiB banks, at least two of them,
+// padded with 0xFF past the end of the file.  Read only and shared by every
+// cartridge loaded from the same contents, whatever the path.
+struct rom_image {
+  const uint8_t* data;
+  size_t length;
+  // Size of the file itself.
+  size_t file_size;
+  // Of the contents, to tell ROMs apart.
+  uint64_t hash;
+};
+
+// Returns NULL on error.  Each acquire_rom needs a matching release_rom; the
+// image is unloaded with the last one.  Safe to call from any thread.
+const struct rom_image* acquire_rom (const char* const path);
+void release_rom (const struct rom_image* const image);
@@ -0,0 +1,46 @@
+#include "scheduler.h"
+
+#include <assert.h>
+#include <string.h>
+
+void init_scheduler (struct scheduler* const s) {
+  s->now = 0;
+  s->count = 0;
+}
+
+void cancel_event (struct scheduler* const s, const enum EventType type) {
+  for (uint8_t i = 0; i < s->count; ++i) {
+    if (s->events[i].type == type) {
+      memmove(&s->events[i], &s->events[i + 1],
+          (s->count - i - 1) * sizeof(struct event));
+      --s->count;
+      return;
+    }
+  }
+}
+
+// A handful of event types, so keeping them in a sorted array beats a heap.
+void schedule_event (struct scheduler* const s, const enum EventType type,
+    const uint64_t when) {
+  assert(type < kNumEvents);
+  cancel_event(s, type);
+  uint8_t i = s->count;
+  // Ties go after existing events, so events due at once run in the order
+  // they were posted.
+  while (i > 0 && s->events[i - 1].when > when) {
+    s->events[i] = s->events[i - 1];
+    --i;
+  }
+  s->events[i].when = when;
+  s->events[i].type = type;
+  ++s->count;
+}
+
+struct event pop_event (struct scheduler* const s) {
+  assert(s->count > 0);
+  assert(s->events[0].when <= s->now);
+  const struct event e = s->events[0];
+  --s->count;
+  memmove(&s->events[0], &s->events[1], s->count * sizeof(struct event));
+  return e;
+}
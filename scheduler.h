@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum __attribute__((packed)) EventType {
+  kEventLcd, // next LCD mode transition
+  kEventDiv, // DIV increment
+  kEventTimer, // TIMA increment
+  kEventSerial, // serial transfer completion
+  kEventInterrupt, // IME, IE or IF changed; look for an interrupt to take
+  kNumEvents,
+};
+
+struct event {
+  uint64_t when;
+  enum EventType type;
+};
+
+struct scheduler {
+  // T-cycles since power on.
+  uint64_t now;
+  // Pending events, soonest first.  There is at most one of each type.
+  struct event events [kNumEvents];
+  uint8_t count;
+};
+
+void init_scheduler (struct scheduler* const s);
+// Replaces any pending event of the same type.
+void schedule_event (struct scheduler* const s, const enum EventType type,
+    const uint64_t when);
+void cancel_event (struct scheduler* const s, const enum EventType type);
+// Removes the soonest event, which must be due.
+struct event pop_event (struct scheduler* const s);
+
+static inline uint64_t next_event_time (const struct scheduler* const s) {
+  return s->count ? s->events[0].when : UINT64_MAX;
+}
+
+// Has interrupts looked at once the current instruction retires.
+static inline void schedule_interrupt_check (struct scheduler* const s) {
+  if (s) {
+    schedule_event(s, kEventInterrupt, s->now);
+  }
+}
@@ -0,0 +1,264 @@
+#include "state.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block_cache.h"
+#include "cartridge.h"
+#include "rom_registry.h"
+#include "system.h"
+#include "tile_cache.h"
+
+#define STATE_MAGIC "PGBS"
+
+// Everything but cartridge RAM, which follows it.  Fields are ordered by
+// size, so there's no padding to leak into the file.
+struct saved_state {
+  char magic [4];
+  uint32_t version;
+  uint32_t cart_ram_length;
+  uint32_t unused_header;
+  // Of the ROM this was saved from; see rom_image.
+  uint64_t rom_hash;
+
+  uint64_t now;
+  uint64_t event_when [kNumEvents];
+  int64_t rtc_epoch;
+  uint64_t rtc_stopped_at;
+
+  uint16_t af, bc, de, hl, sp, pc;
+  uint16_t rom_bank;
+
+  uint8_t event_type [kNumEvents];
+  uint8_t event_count;
+  uint8_t interrupts_enabled;
+  uint8_t cpu_state;
+  uint8_t lcd_mode;
+  uint8_t lcd_line;
+  uint8_t lcd_enabled;
+  uint8_t entered_vblank;
+  uint8_t window_line;
+  uint8_t bios_mapped;
+  uint8_t buttons;
+  uint8_t ram_enabled;
+  uint8_t ram_bank;
+  uint8_t mbc_mode;
+  uint8_t rtc_halted;
+  uint8_t rtc_latched [5];
+  uint8_t rtc_latch_armed;
+  // Rounds the fields above up to a multiple of 8 bytes.
+  uint8_t unused;
+
+  uint8_t wram [0x2000];
+  uint8_t vram [0x2000];
+  uint8_t oam [0x100];
+  uint8_t high [0x100];
+};
+
+_Static_assert(sizeof(struct saved_state) == 17024,
+    "saved_state changed; bump STATE_VERSION and fix this size");
+
+size_t state_size (const struct system* const system) {
+  return sizeof(struct saved_state) + system->mmu.cart.ram_length;
+}
+
+size_t save_state (struct system* const system, void* const buf,
+    const size_t size) {
+  if (size < state_size(system)) return 0;
+  struct cpu* const cpu = &system->cpu;
+  const struct scheduler* const s = &system->scheduler;
+  const struct lcd* const lcd = &system->lcd;
+  const struct mmu* const mmu = &system->mmu;
+  const struct cartridge* const cart = &mmu->cart;
+  struct saved_state* const state = buf;
+
+  memcpy(state->magic, STATE_MAGIC, sizeof(state->magic));
+  state->version = STATE_VERSION;
+  state->cart_ram_length = cart->ram_length;
+  state->unused_header = 0;
+  state->rom_hash = cart->image->hash;
+
+  state->now = s->now;
+  for (int i = 0; i < kNumEvents; ++i) {
+    state->event_when[i] = i < s->count ? s->events[i].when : 0;
+    state->event_type[i] = i < s->count ? s->events[i].type : 0;
+  }
+  state->event_count = s->count;
+  state->rtc_epoch = cart->rtc.epoch;
+  state->rtc_stopped_at = cart->rtc.stopped_at;
+
+  // Saved flags don't depend on USE_LAZY_FLAGS.
+  sync_flags(cpu);
+  state->af = cpu->registers.af;
+  state->bc = cpu->registers.bc;
+  state->de = cpu->registers.de;
+  state->hl = cpu->registers.hl;
+  state->sp = cpu->registers.sp;
+  state->pc = cpu->registers.pc;
+  state->rom_bank = cart->rom_bank;
+
+  state->interrupts_enabled = cpu->interrupts_enabled;
+  state->cpu_state = cpu->state;
+  state->lcd_mode = lcd->mode;
+  state->lcd_line = lcd->line;
+  state->lcd_enabled = lcd->enabled;
+  state->entered_vblank = lcd->entered_vblank;
+  state->window_line = lcd->window_line;
+  state->bios_mapped = mmu->bios_mapped;
+  state->buttons = mmu->buttons;
+  state->ram_enabled = cart->ram_enabled;
+  state->ram_bank = cart->ram_bank;
+  state->mbc_mode = cart->mode;
+  state->rtc_halted = cart->rtc.halted;
+  memcpy(state->rtc_latched, cart->rtc.latched, sizeof(state->rtc_latched));
+  state->rtc_latch_armed = cart->rtc.latch_armed;
+  state->unused = 0;
+
+  memcpy(state->wram, mmu->wram, sizeof(state->wram));
+  memcpy(state->vram, mmu->vram, sizeof(state->vram));
+  memcpy(state->oam, mmu->oam, sizeof(state->oam));
+  memcpy(state->high, mmu->high, sizeof(state->high));
+  if (cart->ram_length) {
+    memcpy(state + 1, cart->ram, cart->ram_length);
+  }
+  return state_size(system);
+}
+
+// Whether the registers and events could have come from a running system,
+// so a corrupt state can't leave it somewhere the emulator never goes.
+static bool is_consistent (const struct saved_state* const state) {
+  if (state->event_count > kNumEvents ||
+      state->cpu_state > kPolling ||
+      state->lcd_mode >= 4 ||
+      state->lcd_line >= 154) {
+    return false;
+  }
+  // Each type at most once, soonest first, none already past.
+  unsigned seen = 0;
+  uint64_t when = state->now;
+  for (int i = 0; i < state->event_count; ++i) {
+    const uint8_t type = state->event_type[i];
+    if (type >= kNumEvents || (seen & (1U << type)) ||
+        state->event_when[i] < when) {
+      return false;
+    }
+    seen |= 1U << type;
+    when = state->event_when[i];
+  }
+  return true;
+}
+
+int load_state (struct system* const system, const void* const buf,
+    const size_t size) {
+  const struct saved_state* const state = buf;
+  struct cpu* const cpu = &system->cpu;
+  struct scheduler* const s = &system->scheduler;
+  struct lcd* const lcd = &system->lcd;
+  struct mmu* const mmu = &system->mmu;
+  struct cartridge* const cart = &mmu->cart;
+
+  if (size < sizeof(*state) ||
+      memcmp(state->magic, STATE_MAGIC, sizeof(state->magic)) ||
+      state->version != STATE_VERSION ||
+      state->cart_ram_length != cart->ram_length ||
+      size < state_size(system) ||
+      state->rom_hash != cart->image->hash ||
+      !is_consistent(state)) {
+    return -1;
+  }
+
+  s->now = state->now;
+  s->count = state->event_count;
+  for (int i = 0; i < s->count; ++i) {
+    s->events[i].when = state->event_when[i];
+    s->events[i].type = state->event_type[i];
+  }
+  cart->rtc.epoch = state->rtc_epoch;
+  cart->rtc.stopped_at = state->rtc_stopped_at;
+
+  cpu->registers.af = state->af;
+  cpu->registers.bc = state->bc;
+  cpu->registers.de = state->de;
+  cpu->registers.hl = state->hl;
+  cpu->registers.sp = state->sp;
+  cpu->registers.pc = state->pc;
+  reset_flags(cpu);
+  cart->rom_bank = state->rom_bank;
+
+  cpu->interrupts_enabled = state->interrupts_enabled;
+  cpu->state = state->cpu_state;
+  lcd->mode = state->lcd_mode;
+  lcd->line = state->lcd_line;
+  lcd->enabled = state->lcd_enabled;
+  lcd->entered_vblank = state->entered_vblank;
+  lcd->window_line = state->window_line;
+  mmu->bios_mapped = state->bios_mapped && mmu->has_bios;
+  mmu->buttons = state->buttons;
+  cart->ram_enabled = state->ram_enabled;
+  cart->ram_bank = state->ram_bank;
+  cart->mode = state->mbc_mode;
+  cart->rtc.halted = state->rtc_halted;
+  memcpy(cart->rtc.latched, state->rtc_latched, sizeof(cart->rtc.latched));
+  cart->rtc.latch_armed = state->rtc_latch_armed;
+
+  memcpy(mmu->wram, state->wram, sizeof(mmu->wram));
+  memcpy(mmu->vram, state->vram, sizeof(mmu->vram));
+  memcpy(mmu->oam, state->oam, sizeof(mmu->oam));
+  memcpy(mmu->high, state->high, sizeof(mmu->high));
+  if (cart->ram_length) {
+    memcpy(cart->ram, state + 1, cart->ram_length);
+  }
+
+  // Memory changed behind the caches' backs, and the banks may have moved.
+  map_cartridge(mmu);
+  cpu->block = NULL;
+  if (mmu->blocks) {
+    flush_block_cache(mmu->blocks);
+  }
+  decode_tiles(lcd->tiles, mmu->vram);
+  memset(&mmu->vram_dirty, 0xFF, sizeof(mmu->vram_dirty));
+  return 0;
+}
+
+int save_state_file (struct system* const system, const char* const path) {
+  int rc = -1;
+  const size_t size = state_size(system);
+  void* const buf = malloc(size);
+  if (!buf) return -1;
+  save_state(system, buf, size);
+  FILE* const f = fopen(path, "wb");
+  if (!f) {
+    perror("unable to open state file");
+    goto free;
+  }
+  rc = fwrite(buf, size, 1, f) == 1 ? 0 : -1;
+  if (fclose(f)) rc = -1;
+  if (rc) perror("unable to write state file");
+free:
+  free(buf);
+  return rc;
+}
+
+int load_state_file (struct system* const system, const char* const path) {
+  int rc = -1;
+  FILE* const f = fopen(path, "rb");
+  if (!f) {
+    perror("unable to open state file");
+    return -1;
+  }
+  // Anything bigger than this system's state can't be one of its states.
+  const size_t size = state_size(system);
+  void* const buf = malloc(size + 1);
+  if (!buf) goto close;
+  const size_t length = fread(buf, 1, size + 1, f);
+  rc = length == size ? load_state(system, buf, length) : -1;
+  if (rc) fprintf(stderr, "%s isn't a state for this cartridge\n", path);
+  free(buf);
+close:
+  fclose(f);
+  return rc;
+}
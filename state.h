@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+
+struct system;
+
+// Bumped whenever the layout of a saved state changes; states of any other
+// version are refused rather than converted.
+#define STATE_VERSION 1
+
+// Saved states are a fixed header, CPU, LCD, scheduler and controller
+// registers, then WRAM, VRAM, OAM and the 0xFF page as they are, then any
+// cartridge RAM.  Like the rest of pocketgb they're in host byte order,
+// which is little endian.  The framebuffer and serial output are output,
+// not state, and aren't saved.
+
+// Bytes save_state needs for this system.
+size_t state_size (const struct system* const system);
+// buf must be aligned as malloc's are.
+// Returns the bytes written, or 0 if size is too small.
+size_t save_state (struct system* const system, void* const buf,
+    const size_t size);
+// Returns 0 on success, or -1 if buf doesn't hold a consistent state of this
+// version for this cartridge, in which case the system is left alone.
+int load_state (struct system* const system, const void* const buf,
+    const size_t size);
+
+// The same, as a file of exactly those bytes.
+// Returns 0 on success
+int save_state_file (struct system* const system, const char* const path);
+int load_state_file (struct system* const system, const char* const path);
@@ -0,0 +1,107 @@
+#include "system.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "timer.h"
+
+int init_system (const char* const restrict bios,
+    const char* const restrict rom, const bool persist_saves,
+    struct system* const restrict system) {
+  assert(rom != NULL);
+  assert(system != NULL);
+  struct mmu* const mmu = &system->mmu;
+  if (init_memory(mmu, bios, rom, persist_saves)) return -1;
+  init_scheduler(&system->scheduler);
+  mmu->scheduler = &system->scheduler;
+  // TODO: registers get initialized differently based on model
+  if (init_cpu(&system->cpu, mmu)) {
+    deinit_memory(mmu);
+    return -1;
+  }
+  init_lcd(&system->lcd, mmu, &system->tiles, system->framebuffer);
+  schedule_event(&system->scheduler, kEventLcd, OAM_CYCLES);
+  start_timer(mmu);
+  schedule_interrupt_check(&system->scheduler);
+  return 0;
+}
+
+void deinit_system (struct system* const system) {
+  struct mmu* const mmu = system->cpu.mmu;
+  deinit_cpu(&system->cpu);
+  deinit_memory(mmu);
+}
+
+static void dispatch (struct system* const system, const struct event e) {
+  struct mmu* const mmu = system->cpu.mmu;
+  switch (e.type) {
+    case kEventLcd:
+      schedule_event(&system->scheduler, kEventLcd,
+          e.when + step_lcd(&system->lcd));
+      break;
+    case kEventDiv:
+      on_div_event(mmu, e.when);
+      break;
+    case kEventTimer:
+      on_timer_event(mmu, e.when);
+      break;
+    case kEventSerial:
+      on_serial_event(mmu);
+      break;
+    case kEventInterrupt:
+      system->scheduler.now += handle_interrupts(&system->cpu);
+      break;
+    default:
+      assert(false);
+  }
+}
+
+// Runs the CPU uninterrupted up to the next due event or end, then handles
+// every event that has come due.  A halted CPU costs nothing in between.
+// Stops early once a frame completes if stop_at_vblank.
+static uint32_t run_until (struct system* const system, const uint64_t end,
+    const bool stop_at_vblank) {
+  struct cpu* const cpu = &system->cpu;
+  struct scheduler* const s = &system->scheduler;
+  const uint64_t start = s->now;
+  while (s->now < end) {
+    // Instructions may post events, so the deadline is reread each time.
+    while (s->now < end && s->now < next_event_time(s)) {
+      if (cpu->state != kRunning) {
+        // Only an event can wake the CPU, so skip straight to it.
+        const uint64_t next = next_event_time(s);
+        s->now = next < end ? next : end;
+        break;
+      }
+      tick_once(cpu, end);
+      s->now += cpu->tick_cycles;
+    }
+    while (next_event_time(s) <= s->now) {
+      dispatch(system, pop_event(s));
+    }
+    // Whatever a polling loop was waiting on may have just changed.
+    if (cpu->state == kPolling) {
+      cpu->state = kRunning;
+    }
+    if (stop_at_vblank && system->lcd.entered_vblank) {
+      break;
+    }
+  }
+  return s->now - start;
+}
+
+uint32_t run_cycles (struct system* const system, const uint32_t cycles) {
+  return run_until(system, system->scheduler.now + cycles, false);
+}
+
+uint32_t run_frame (struct system* const system) {
+  system->lcd.entered_vblank = false;
+  const uint32_t elapsed =
+    run_until(system, system->scheduler.now + CYCLES_PER_FRAME, true);
+  flush_cartridge(&system->cpu.mmu->cart);
+  return elapsed;
+}
+
+const struct serial* serial_output (const struct system* const system) {
+  return &system->cpu.mmu->serial;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "lcd.h"
+#include "scheduler.h"
+
+// T-cycles per frame: 154 lines of 456 cycles.
+#define CYCLES_PER_FRAME 70224
+
+// The machine state runs from cpu to the end of mmu, with what every
+// instruction touches in the first cache line.
+struct system {
+  struct cpu cpu;
+  struct scheduler scheduler;
+  struct lcd lcd;
+  struct mmu mmu;
+  // Decoded VRAM and the picture so far: derived state and output.
+  struct tile_cache tiles;
+  uint8_t framebuffer [SCREEN_HEIGHT][SCREEN_WIDTH];
+} __attribute__((aligned(64)));
+
+_Static_assert(offsetof(struct system, tiles) < 32 * 1024,
+    "machine state should stay well under 32 KiB");
+
+// Returns 0 on success
+__attribute__((nonnull(2)))
+// See load_cartridge for persist_saves.
+int init_system (const char* const restrict bios,
+    const char* const restrict rom, const bool persist_saves,
+    struct system* const restrict system);
+void deinit_system (struct system* const system);
+// Runs for at least cycles T-cycles, handling events as they come due, and
+// returns how many actually elapsed.
+uint32_t run_cycles (struct system* const system, const uint32_t cycles);
+// Runs until the LCD enters VBlank, or for a frame's worth of cycles if the
+// LCD is off, returning the cycles elapsed.  Battery RAM starts writing back
+// at the end of each frame.
+uint32_t run_frame (struct system* const system);
+// Everything the ROM has sent over serial so far.
+const struct serial* serial_output (const struct system* const system);
@@ -0,0 +1,145 @@
+#include "tile_cache.h"
+
+#include <assert.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_DECODERS
+#endif
+
+// http://www.huderlem.com/demos/gameboy2bpp.html
+static void decode_row (uint8_t* const row, const uint8_t low,
+    const uint8_t high) {
+  for (int x = 0; x < 8; ++x) {
+    const int bit = 7 - x;
+    row[x] = (((high >> bit) & 1) << 1) | ((low >> bit) & 1);
+  }
+}
+
+static void decode_rows_scalar (uint8_t* restrict out,
+    const uint8_t* restrict planes, size_t rows) {
+  for (; rows; --rows, out += 8, planes += 2) {
+    decode_row(out, planes[0], planes[1]);
+  }
+}
+
+#ifdef HAVE_X86_DECODERS
+// Each of a vector's 8 byte lanes tests one bit, most significant first.
+#define BIT_LANES 0x0102040810204080LL
+
+// Turns a plane byte repeated across each half of v into 0 or value per
+// pixel.
+static inline __m128i expand_sse2 (const __m128i v, const __m128i bits,
+    const __m128i value) {
+  return _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(v, bits), bits), value);
+}
+
+// 8 rows at a time.  Without pshufb, repeated unpacking spreads each plane
+// byte over 8 lanes.
+__attribute__((target("sse2")))
+static void decode_rows_sse2 (uint8_t* restrict out,
+    const uint8_t* restrict planes, size_t rows) {
+  const __m128i bits = _mm_set1_epi64x(BIT_LANES);
+  const __m128i ones = _mm_set1_epi8(1);
+  const __m128i twos = _mm_set1_epi8(2);
+  const __m128i bytes = _mm_set1_epi16(0x00FF);
+  const __m128i zero = _mm_setzero_si128();
+  for (; rows >= 8; rows -= 8, out += 64, planes += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i*)planes);
+    const __m128i lows = _mm_packus_epi16(_mm_and_si128(v, bytes), zero);
+    const __m128i highs = _mm_packus_epi16(_mm_srli_epi16(v, 8), zero);
+    const __m128i lows8 = _mm_unpacklo_epi8(lows, lows);
+    const __m128i highs8 = _mm_unpacklo_epi8(highs, highs);
+    const __m128i lows16 [2] = {
+      _mm_unpacklo_epi16(lows8, lows8), _mm_unpackhi_epi16(lows8, lows8),
+    };
+    const __m128i highs16 [2] = {
+      _mm_unpacklo_epi16(highs8, highs8), _mm_unpackhi_epi16(highs8, highs8),
+    };
+    for (int i = 0; i < 2; ++i) {
+      const __m128i l0 = _mm_unpacklo_epi32(lows16[i], lows16[i]);
+      const __m128i l1 = _mm_unpackhi_epi32(lows16[i], lows16[i]);
+      const __m128i h0 = _mm_unpacklo_epi32(highs16[i], highs16[i]);
+      const __m128i h1 = _mm_unpackhi_epi32(highs16[i], highs16[i]);
+      _mm_storeu_si128((__m128i*)(out + 32 * i),
+          _mm_or_si128(expand_sse2(l0, bits, ones),
+            expand_sse2(h0, bits, twos)));
+      _mm_storeu_si128((__m128i*)(out + 32 * i + 16),
+          _mm_or_si128(expand_sse2(l1, bits, ones),
+            expand_sse2(h1, bits, twos)));
+    }
+  }
+  decode_rows_scalar(out, planes, rows);
+}
+
+// 4 rows at a time.  Their 8 bytes go to both 128 bit lanes, then vpshufb
+// spreads each plane byte over the 8 lanes of its row.
+__attribute__((target("avx2")))
+static void decode_rows_avx2 (uint8_t* restrict out,
+    const uint8_t* restrict planes, size_t rows) {
+  const __m256i bits = _mm256_set1_epi64x(BIT_LANES);
+  const __m256i ones = _mm256_set1_epi8(1);
+  const __m256i twos = _mm256_set1_epi8(2);
+  const __m256i low_index = _mm256_setr_epi8(
+      0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 2, 2, 2, 2,
+      4, 4, 4, 4, 4, 4, 4, 4, 6, 6, 6, 6, 6, 6, 6, 6);
+  const __m256i high_index = _mm256_add_epi8(low_index, ones);
+  for (; rows >= 4; rows -= 4, out += 32, planes += 8) {
+    const __m256i v = _mm256_broadcastq_epi64(
+        _mm_loadl_epi64((const __m128i*)planes));
+    const __m256i l = _mm256_shuffle_epi8(v, low_index);
+    const __m256i h = _mm256_shuffle_epi8(v, high_index);
+    const __m256i pl = _mm256_and_si256(
+        _mm256_cmpeq_epi8(_mm256_and_si256(l, bits), bits), ones);
+    const __m256i ph = _mm256_and_si256(
+        _mm256_cmpeq_epi8(_mm256_and_si256(h, bits), bits), twos);
+    _mm256_storeu_si256((__m256i*)out, _mm256_or_si256(pl, ph));
+  }
+  decode_rows_scalar(out, planes, rows);
+}
+#endif
+
+static const struct tile_decoder decoders [] = {
+  { "scalar", decode_rows_scalar },
+#ifdef HAVE_X86_DECODERS
+  { "sse2", decode_rows_sse2 },
+  { "avx2", decode_rows_avx2 },
+#endif
+};
+
+size_t available_tile_decoders (const struct tile_decoder** const list) {
+  *list = decoders;
+#ifdef HAVE_X86_DECODERS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return 3;
+  if (__builtin_cpu_supports("sse2")) return 2;
+#endif
+  return 1;
+}
+
+// Picked once before main, so later calls never race on it.
+static tile_row_decoder best_decoder = decode_rows_scalar;
+
+__attribute__((constructor))
+static void pick_decoder (void) {
+  const struct tile_decoder* list;
+  const size_t count = available_tile_decoders(&list);
+  best_decoder = list[count - 1].decode;
+}
+
+void decode_tile_rows (uint8_t* restrict out, const uint8_t* restrict planes,
+    const size_t rows) {
+  best_decoder(out, planes, rows);
+}
+
+void decode_tile_row (struct tile_cache* const cache,
+    const uint8_t* const vram, const uint16_t offset) {
+  assert(offset < 0x1800);
+  const uint16_t even = offset & ~1;
+  decode_row(cache->pixels[offset >> 4][(offset >> 1) & 7], vram[even],
+      vram[even + 1]);
+}
+
+void decode_tiles (struct tile_cache* const cache, const uint8_t* const vram) {
+  decode_tile_rows(&cache->pixels[0][0][0], vram, 0x1800 / 2);
+}
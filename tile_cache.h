@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// VRAM tiles decoded from 2bpp planar data to a palette number per pixel.
+struct tile_cache {
+  uint8_t pixels [384][8][8];
+};
+
+// Decodes rows of tiles, each the 2 bytes of low then high bit planes, into 8
+// palette numbers per row.
+typedef void (*tile_row_decoder) (uint8_t* restrict out,
+    const uint8_t* restrict planes, size_t rows);
+
+struct tile_decoder {
+  const char* name;
+  tile_row_decoder decode;
+};
+
+// The variants this CPU can run, scalar first.  Returns how many.
+size_t available_tile_decoders (const struct tile_decoder** const decoders);
+// Decodes with the fastest variant, picked at startup.
+void decode_tile_rows (uint8_t* restrict out, const uint8_t* restrict planes,
+    const size_t rows);
+
+// Decodes the row whose low and high bit planes are at vram[offset & ~1] and
+// vram[offset | 1], offset being relative to 0x8000.
+void decode_tile_row (struct tile_cache* const cache,
+    const uint8_t* const vram, const uint16_t offset);
+// Decodes all 384 tiles from the 0x1800 bytes at vram.
+void decode_tiles (struct tile_cache* const cache, const uint8_t* const vram);
@@ -0,0 +1,50 @@
+#include "timer.h"
+
+#include <stdio.h>
+
+#include "logging.h"
+#include "scheduler.h"
+
+// DIV counts at 16384Hz.
+#define DIV_PERIOD 256
+
+// T-cycles per TIMA increment for each TAC clock select.
+static const uint16_t tima_periods [4] = { 1024, 16, 64, 256 };
+
+static int timer_enabled (const uint8_t tac) {
+  return !!(tac & (1 << 2));
+}
+
+void start_timer (struct mmu* const mem) {
+  schedule_event(mem->scheduler, kEventDiv, mem->scheduler->now + DIV_PERIOD);
+  tac_write(mem, mem->io[0x07]);
+}
+
+void on_div_event (struct mmu* const mem, const uint64_t when) {
+  ++mem->io[0x04];
+  schedule_event(mem->scheduler, kEventDiv, when + DIV_PERIOD);
+}
+
+void on_timer_event (struct mmu* const mem, const uint64_t when) {
+  const uint8_t tac = mem->io[0x07];
+  if (++mem->io[0x05] == 0) {
+    LOG(7, "TIMA overflow\n");
+    mem->io[0x05] = mem->io[0x06]; // TMA
+    wb(mem, 0xFF0F, rb(mem, 0xFF0F) | 0x04);
+  }
+  schedule_event(mem->scheduler, kEventTimer, when + tima_periods[tac & 3]);
+}
+
+void tac_write (struct mmu* const mem, const uint8_t val) {
+  if (timer_enabled(val)) {
+    schedule_event(mem->scheduler, kEventTimer,
+        mem->scheduler->now + tima_periods[val & 3]);
+  } else {
+    cancel_event(mem->scheduler, kEventTimer);
+  }
+}
+
+// Any write clears DIV and restarts its count.
+void div_write (struct mmu* const mem) {
+  schedule_event(mem->scheduler, kEventDiv, mem->scheduler->now + DIV_PERIOD);
+}
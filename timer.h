@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mmu.h"
+
+// DIV (0xFF04) and TIMA (0xFF05), driven by scheduler events.
+
+void start_timer (struct mmu* const mem);
+void on_div_event (struct mmu* const mem, const uint64_t when);
+void on_timer_event (struct mmu* const mem, const uint64_t when);
+void tac_write (struct mmu* const mem, const uint8_t val);
+void div_write (struct mmu* const mem);
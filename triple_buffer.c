@@ -0,0 +1,66 @@
+#include "triple_buffer.h"
+
+#include <string.h>
+
+#define kFreshFrame 0x4
+#define kFrameIndex 0x3
+
+void init_triple_buffer (struct triple_buffer* const tb) {
+  memset(tb->frames, 0, sizeof(tb->frames));
+  tb->back = 0;
+  tb->vram_version = 0;
+  memset(&tb->captured, 0, sizeof(tb->captured));
+  memset(&tb->unseen, 0, sizeof(tb->unseen));
+  atomic_init(&tb->middle, 1);
+  tb->front = 2;
+}
+
+static void add_vram_dirty (struct vram_dirty* const into,
+    const struct vram_dirty* const from) {
+  for (size_t i = 0; i < VRAM_TILES / 64; ++i) {
+    into->tiles[i] |= from->tiles[i];
+  }
+  for (size_t i = 0; i < VRAM_MAP_ENTRIES / 64; ++i) {
+    into->maps[i] |= from->maps[i];
+  }
+}
+
+void capture_frame (struct triple_buffer* const tb, const struct lcd* const lcd,
+    const bool with_vram) {
+  struct frame* const frame = &tb->frames[tb->back];
+  memcpy(frame->pixels, lcd->framebuffer, sizeof(frame->pixels));
+  memset(&tb->captured, 0, sizeof(tb->captured));
+  // Skip 0, which means not captured.
+  if (take_vram_dirty(lcd->mmu, &tb->captured) && !++tb->vram_version) {
+    tb->vram_version = 1;
+  }
+  add_vram_dirty(&tb->unseen, &tb->captured);
+  frame->vram_version = with_vram ? tb->vram_version : 0;
+  if (with_vram) {
+    memcpy(frame->vram, lcd->mmu->vram, sizeof(frame->vram));
+    frame->lcdc = lcd->mmu->io[0x40];
+    frame->dirty = tb->unseen;
+  }
+}
+
+void publish_frame (struct triple_buffer* const tb) {
+  const uint_fast8_t old = atomic_exchange_explicit(&tb->middle,
+      tb->back | kFreshFrame, memory_order_acq_rel);
+  tb->back = old & kFrameIndex;
+  // The reader took the frame before this one, so from here on it only lacks
+  // what this one changed.  Otherwise that frame's changes are still unseen.
+  if (!(old & kFreshFrame)) {
+    tb->unseen = tb->captured;
+  }
+}
+
+const struct frame* acquire_frame (struct triple_buffer* const tb) {
+  if (!(atomic_load_explicit(&tb->middle, memory_order_acquire) &
+        kFreshFrame)) {
+    return NULL;
+  }
+  const uint_fast8_t old = atomic_exchange_explicit(&tb->middle, tb->front,
+      memory_order_acq_rel);
+  tb->front = old & kFrameIndex;
+  return &tb->frames[tb->front];
+}
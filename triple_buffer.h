@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "lcd.h"
+
+// What the presenter needs of one emulated frame.
+struct frame {
+  uint8_t pixels [SCREEN_HEIGHT][SCREEN_WIDTH];
+  // Changes whenever VRAM does; 0 if vram and lcdc weren't captured.
+  uint32_t vram_version;
+  uint8_t lcdc;
+  // Tiles and map entries written since the last frame the reader took.
+  struct vram_dirty dirty;
+  uint8_t vram [0x2000];
+};
+
+// Hands frames from one writer to one reader without either ever waiting.
+// The writer fills back while the reader shows front; middle holds whichever
+// frame was published last.
+struct triple_buffer {
+  struct frame frames [3];
+  // Owned by the writer.
+  uint8_t back;
+  uint32_t vram_version;
+  // What the back frame's capture took from VRAM, and everything taken since
+  // the reader last took a frame.
+  struct vram_dirty captured;
+  struct vram_dirty unseen;
+  // Owned by the reader.
+  uint8_t front;
+  // Index of the middle frame, plus kFreshFrame until the reader takes it.
+  atomic_uint_fast8_t middle;
+};
+
+void init_triple_buffer (struct triple_buffer* const tb);
+// Copies the LCD's last frame into the back buffer, and VRAM along with it if
+// with_vram.
+void capture_frame (struct triple_buffer* const tb, const struct lcd* const lcd,
+    const bool with_vram);
+// Makes the back buffer the newest frame.
+void publish_frame (struct triple_buffer* const tb);
+// Returns the newest published frame, or NULL if there's been none since the
+// last call.
+const struct frame* acquire_frame (struct triple_buffer* const tb);
@@ -0,0 +1,235 @@
+#include "window.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SDL_render.h"
+#include "SDL_timer.h"
+
+#include "triple_buffer.h"
+
+// Shades 0 (white) to 3 (black), and palette numbers in the debug windows.
+static const uint32_t shade_colors [4] = {
+  0xFFFFFFFF, 0xFFAAAAAA, 0xFF555555, 0xFF000000,
+};
+
+static void blit_tile (const uint8_t* tile_data, struct winren* const w,
+    const int dx, const int dy) {
+  uint32_t* dest = w->pixels + dy * w->width + dx;
+  for (int sy = 0; sy < 8; ++sy) {
+    for (int sx = 0; sx < 8; ++sx) {
+      dest[sx] = shade_colors[tile_data[sx]];
+    }
+    tile_data += 8;
+    dest += w->width;
+  }
+}
+
+static const uint8_t* seek_tile (const uint8_t* tile_data, unsigned int i) {
+  // 384 tiles in total
+  assert(i < VRAM_TILES);
+  // 8px x 8px per tile
+  return tile_data + i * 64;
+}
+
+// One upload and one copy, however much changed.
+static void present (struct winren* const w) {
+  SDL_UpdateTexture(w->texture, NULL, w->pixels, w->width * sizeof(uint32_t));
+  SDL_RenderClear(w->renderer);
+  SDL_RenderCopy(w->renderer, w->texture, NULL, NULL);
+  SDL_RenderPresent(w->renderer);
+}
+
+static bool is_dirty (const uint64_t* const bits, const unsigned i) {
+  return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+// Repaints the 256 tiles of the active tileset, which start at first; only
+// those in dirty unless all.
+static void paint_tiles (const uint8_t* const tile_data, const int first,
+    const struct vram_dirty* const dirty, const bool all,
+    struct winren* const w) {
+  // 256 tiles in total
+  for (int tile = 0; tile < 256; ++tile) {
+    if (!all && !is_dirty(dirty->tiles, first + tile)) continue;
+    // 16 rows, 16 columns, 8px per tile
+    int dx = (tile % 16) * 8;
+    int dy = (tile / 16) * 8;
+    blit_tile(seek_tile(tile_data, first + tile), w, dx, dy);
+  }
+  present(w);
+}
+
+// Likewise for the map whose entries start at first_entry, an entry also
+// needing a repaint if the tile it shows changed.
+static void map_tiles (const uint8_t* const map_data, const int first_entry,
+    const uint8_t* const tile_data, const int first,
+    const struct vram_dirty* const dirty, const bool all,
+    struct winren* const w) {
+  for (int map = 0; map < 32 * 32; ++map) {
+    const int tile = first + map_data[map];
+    if (!all && !is_dirty(dirty->maps, first_entry + map) &&
+        !is_dirty(dirty->tiles, tile)) {
+      continue;
+    }
+    int dx = (map % 32) * 8;
+    int dy = (map / 32) * 8;
+    blit_tile(seek_tile(tile_data, tile), w, dx, dy);
+  }
+  present(w);
+}
+
+static void perror_sdl (const char* const msg) {
+  fprintf(stderr, "%s: %s\n", msg, SDL_GetError());
+}
+
+static SDL_Renderer* get_cleared_renderer (SDL_Window* const window) {
+  if (!window) {
+    perror_sdl("unable to open window");
+    return NULL;
+  }
+  SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, 0);
+  if (!renderer) {
+    perror_sdl("unable to create renderer");
+    // TODO: close window?
+    return NULL;
+  }
+  SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+  SDL_RenderClear(renderer);
+  SDL_RenderPresent(renderer);
+  return renderer;
+}
+
+// A window of width x height pixels, shown scale times larger.
+static void create_winren (struct winren* const w, const char* const title,
+    const int width, const int height, const int scale) {
+  w->window = SDL_CreateWindow(title, SDL_WINDOWPOS_UNDEFINED,
+      SDL_WINDOWPOS_UNDEFINED, width * scale, height * scale, 0);
+  w->renderer = get_cleared_renderer(w->window);
+  w->texture = w->renderer ?
+    SDL_CreateTexture(w->renderer, SDL_PIXELFORMAT_ARGB8888,
+        SDL_TEXTUREACCESS_STREAMING, width, height) : NULL;
+  if (w->renderer && !w->texture) {
+    perror_sdl("unable to create texture");
+  }
+  w->pixels = calloc(width * height, sizeof(uint32_t));
+  w->width = width;
+  w->height = height;
+}
+
+static void destroy_winren (struct winren* const w) {
+  free(w->pixels);
+  SDL_DestroyTexture(w->texture);
+  SDL_DestroyRenderer(w->renderer);
+  SDL_DestroyWindow(w->window);
+}
+
+void create_windows (struct windows* const windows, const bool debug_enabled,
+    const uint32_t debug_hz) {
+  create_winren(&windows->main, "pocketgb", SCREEN_WIDTH, SCREEN_HEIGHT, 3);
+  create_winren(&windows->tiles, "Debug Tileset", 16 * 8, 16 * 8, 2);
+  create_winren(&windows->tilemap, "Debug Tilemapped Tiles", 32 * 8, 32 * 8,
+      2);
+  windows->debug_interval = debug_hz ? 1000 / debug_hz : 0;
+  windows->last_debug_refresh = 0;
+  windows->painted_vram_version = 0;
+  windows->painted_lcdc = 0;
+  memset(&windows->pending, 0, sizeof(windows->pending));
+  // Flipped so set_debug_windows shows or hides them.
+  windows->debug_enabled = !debug_enabled;
+  set_debug_windows(windows, debug_enabled);
+}
+
+void set_debug_windows (struct windows* const windows, const bool enabled) {
+  if (enabled == windows->debug_enabled) return;
+  windows->debug_enabled = enabled;
+  if (enabled) {
+    windows->debug_stale = true;
+    SDL_ShowWindow(windows->tiles.window);
+    SDL_ShowWindow(windows->tilemap.window);
+  } else {
+    SDL_HideWindow(windows->tiles.window);
+    SDL_HideWindow(windows->tilemap.window);
+  }
+}
+
+void update_main_window (struct windows* const windows,
+    const struct frame* const frame) {
+  struct winren* const w = &windows->main;
+  if (!w->texture || !w->pixels) return;
+  const uint8_t* const shades = &frame->pixels[0][0];
+  for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; ++i) {
+    w->pixels[i] = shade_colors[shades[i]];
+  }
+  present(w);
+}
+
+// http://www.huderlem.com/demos/gameboy2bpp.html
+void update_debug_windows (struct windows* const windows,
+    const struct frame* const frame) {
+  if (!windows->debug_enabled || !frame->vram_version) {
+    return;
+  }
+  // Kept even if this frame isn't painted, for the one that is.
+  for (size_t i = 0; i < VRAM_TILES / 64; ++i) {
+    windows->pending.tiles[i] |= frame->dirty.tiles[i];
+  }
+  for (size_t i = 0; i < VRAM_MAP_ENTRIES / 64; ++i) {
+    windows->pending.maps[i] |= frame->dirty.maps[i];
+  }
+  const uint32_t now = SDL_GetTicks();
+  if (windows->debug_interval &&
+      now - windows->last_debug_refresh < windows->debug_interval) {
+    return;
+  }
+  windows->last_debug_refresh = now;
+
+  if (frame->vram_version == windows->painted_vram_version &&
+      !windows->debug_stale) {
+    return;
+  }
+  // Switching tile data or map shows different tiles everywhere.
+  const bool all =
+    windows->debug_stale || frame->lcdc != windows->painted_lcdc;
+  windows->painted_vram_version = frame->vram_version;
+  windows->painted_lcdc = frame->lcdc;
+  windows->debug_stale = false;
+
+  if (!windows->tiles.texture || !windows->tiles.pixels ||
+      !windows->tilemap.texture || !windows->tilemap.pixels) {
+    return;
+  }
+
+  // The emulator's own cache belongs to its thread, so decode the snapshot,
+  // or just the tiles written since it was last decoded.
+  const struct vram_dirty* const dirty = &windows->pending;
+  if (all) {
+    decode_tiles(&windows->tile_cache, frame->vram);
+  } else {
+    for (unsigned tile = 0; tile < VRAM_TILES; ++tile) {
+      if (is_dirty(dirty->tiles, tile)) {
+        // 16 bytes of bit planes per tile
+        decode_tile_rows(&windows->tile_cache.pixels[tile][0][0],
+            &frame->vram[tile * 16], 8);
+      }
+    }
+  }
+  // BG & Window Tile Data Select; 0x8800 is tile 128.
+  const int first = frame->lcdc & (1 << 4) ? 0 : 128;
+  const uint8_t* const tile_data = &windows->tile_cache.pixels[0][0][0];
+  paint_tiles(tile_data, first, dirty, all, &windows->tiles);
+
+  // BG Tile Map Display Select
+  const int first_entry = frame->lcdc & (1 << 3) ? 0x400 : 0;
+  map_tiles(&frame->vram[0x1800 + first_entry], first_entry, tile_data, first,
+      dirty, all, &windows->tilemap);
+  memset(&windows->pending, 0, sizeof(windows->pending));
+}
+
+void destroy_windows (struct windows* windows) {
+  destroy_winren(&windows->main);
+  destroy_winren(&windows->tiles);
+  destroy_winren(&windows->tilemap);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SDL_render.h"
+#include "SDL_video.h"
+#include "mmu.h"
+#include "tile_cache.h"
+
+struct winren {
+  SDL_Window* window;
+  SDL_Renderer* renderer;
+  // Streamed from pixels, ARGB8888, once per refresh.
+  SDL_Texture* texture;
+  uint32_t* pixels;
+  int width;
+  int height;
+};
+
+struct windows {
+  struct winren main;
+  struct winren tiles;
+  struct winren tilemap;
+  // While off, the debug viewers are hidden and never touched.
+  bool debug_enabled;
+  // Minimum milliseconds between debug refreshes, or 0 for every VBlank.
+  uint32_t debug_interval;
+  uint32_t last_debug_refresh;
+  // Needs repainting even if VRAM hasn't changed, as after being hidden.
+  bool debug_stale;
+  uint32_t painted_vram_version;
+  uint8_t painted_lcdc;
+  // Written since the last repaint, from every frame since.
+  struct vram_dirty pending;
+  // Decoded from each frame's VRAM snapshot, as it changes.
+  struct tile_cache tile_cache;
+};
+
+struct frame;
+
+// The main LCD window and the debug viewers, which refresh at most debug_hz
+// times a second, or every VBlank if 0.
+void create_windows (struct windows* const windows, const bool debug_enabled,
+    const uint32_t debug_hz);
+void set_debug_windows (struct windows* const windows, const bool enabled);
+// Shows a complete frame, from the presenting thread.
+void update_main_window (struct windows* const windows,
+    const struct frame* const frame);
+// Call for each presented frame; does nothing if refreshed too recently or if
+// the frame has no VRAM snapshot.
+void update_debug_windows (struct windows* const windows,
+    const struct frame* const frame);
+void destroy_windows (struct windows* windows);